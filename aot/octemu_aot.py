@@ -0,0 +1,230 @@
+#!/usr/bin/env python3
+"""
+Static recompiler: turns CHIP-8 ROMs into C code for octemu_set_static_code().
+
+Control flow is followed from 0x200 through jumps, calls, returns and skips. Each
+reachable run of register instructions becomes a C function that executes it and
+returns the next PC, ending at a jump or skip (compiled too) or before the first
+instruction that is not compiled: calls, returns, Bnnn, Fx0A, drawing, memory
+access and delay timer wait loops (Fx07, 3x00, jump back). The core runs those
+instructions, code only reached through Bnnn, and the whole ROM once it overwrites
+compiled instructions, in the interpreter.
+
+    octemu_aot.py -o roms_aot.c pong.ch8:chip8 tetris.ch8:chip8 ...
+
+writes one translation unit with an OctEmuStaticCode per ROM (octo mode by default)
+and the table octemu_aot_roms[] of all of them. Build with OCTEMU_AOT.
+"""
+
+import re
+
+MODES = {"chip8": "OCTEMU_MODE_CHIP8", "schip": "OCTEMU_MODE_SCHIP", "octo": "OCTEMU_MODE_OCTO"}
+BLOCK_MAX = 64  # instructions per block
+
+HEADER = """\
+// Generated by octemu_aot.py, do not edit.
+
+#include <stddef.h>
+#include <string.h>
+
+#include "core.h"
+"""
+
+
+def rom_hash(data: bytes) -> int:
+    """octemu_rom_hash()"""
+    h = 0xCBF29CE484222325
+    for b in data:
+        h = ((h ^ b) * 0x100000001B3) & 0xFFFFFFFFFFFFFFFF
+    return h
+
+
+def translate(ins: int, pc: int, mode: str):
+    """
+    C statements of the instruction at pc and, if it ends the block, the C expression of
+    the next PC. None if the instruction is left to the interpreter.
+    """
+    op, x, y, n = ins >> 12, ins >> 8 & 0xF, ins >> 4 & 0xF, ins & 0xF
+    nn, nnn = ins & 0xFF, ins & 0xFFF
+    vx, vy = f"v[0x{x:X}]", f"v[0x{y:X}]"
+
+    def skip(cond: str):
+        return [], f"{cond} ? 0x{pc + 4:03X} : 0x{pc + 2:03X}"
+
+    if op == 0x1:  # invalid targets are left to the interpreter to report
+        return ([], f"0x{nnn:03X}") if 0x200 <= nnn <= 0xFFE else None
+    if op == 0x3:
+        return skip(f"{vx} == 0x{nn:02X}")
+    if op == 0x4:
+        return skip(f"{vx} != 0x{nn:02X}")
+    if op == 0x5 and not n:
+        return skip(f"{vx} == {vy}")
+    if op == 0x9 and not n:
+        return skip(f"{vx} != {vy}")
+    if op == 0xE and nn == 0x9E:
+        return skip(f"keypad >> ({vx} & 0xF) & 1")
+    if op == 0xE and nn == 0xA1:
+        return skip(f"!(keypad >> ({vx} & 0xF) & 1)")
+    if op == 0x6:
+        return [f"{vx} = 0x{nn:02X};"], None
+    if op == 0x7:
+        return [f"{vx} += 0x{nn:02X};"], None
+    if op == 0x8:
+        src = vx if mode == "schip" else vy  # shifts
+        if n == 0x0:
+            return [f"{vx} = {vy};"], None
+        if n in (0x1, 0x2, 0x3):
+            stmts = [f"{vx} {'|&^'[n - 1]}= {vy};"]
+            if mode == "chip8":
+                stmts.append("v[0xF] = 0;")
+            return stmts, None
+        flag = {
+            0x4: [f"f = {vx} > 0xFF - {vy};", f"{vx} += {vy};"],
+            0x5: [f"f = {vx} >= {vy};", f"{vx} -= {vy};"],
+            0x6: [f"f = {src} & 1;", f"{vx} = {src} >> 1;"],
+            0x7: [f"f = {vy} >= {vx};", f"{vx} = {vy} - {vx};"],
+            0xE: [f"f = {src} >> 7;", f"{vx} = {src} << 1;"],
+        }.get(n)
+        return (flag + ["v[0xF] = f;"], None) if flag else None
+    if op == 0xA:
+        return [f"i = 0x{nnn:03X};"], None
+    if op == 0xC:  # xorshift32, as the interpreter
+        return ["r = emu->rng;", "r ^= r << 13;", "r ^= r >> 17;", "r ^= r << 5;",
+                "emu->rng = r;", f"{vx} = r >> 24 & 0x{nn:02X};"], None
+    if op == 0xF:
+        stmts = {
+            0x07: f"{vx} = emu->delay;",
+            0x15: f"emu->delay = {vx};",
+            0x18: f"emu->sound = {vx};",
+            0x1E: f"i += {vx};",
+            0x29: f"i = ({vx} & 0xF) * 5;",
+            0x30: f"i = 80 + ({vx} & 0xF) * 10;",
+            0x75: f"memcpy(emu->rpl, v, {x + 1});",
+            0x85: f"memcpy(v, emu->rpl, {x + 1});",
+        }.get(nn)
+        return ([stmts], None) if stmts else None
+    return None
+
+
+def successors(ins: int, pc: int):
+    """PCs the instruction at pc can continue at, known statically"""
+    op, nn, nnn = ins >> 12, ins & 0xFF, ins & 0xFFF
+    if op == 0x0:
+        if ins >> 8 or nn in (0x00, 0xFD, 0xEE):  # invalid, exit, return
+            return []
+        return [pc + 2]
+    if op == 0x1:
+        return [nnn]
+    if op == 0x2:
+        return [nnn, pc + 2]
+    if op in (0x3, 0x4, 0x5, 0x9) or (op == 0xE and nn in (0x9E, 0xA1)):
+        return [pc + 2, pc + 4]
+    if op == 0xB:  # indirect
+        return []
+    return [pc + 2]
+
+
+def recompile(data: bytes, mode: str, name: str) -> str:
+    """C code of the blocks of a ROM and the OctEmuStaticCode `name` for them."""
+    size = len(data)
+
+    def fetch(pc: int):
+        return data[pc - 0x200] << 8 | data[pc - 0x1FF] if 0x200 <= pc <= 0x200 + size - 2 else None
+
+    # reachable instructions, and the ones blocks start at: jump and skip targets and
+    # instructions after those run by the interpreter
+    reached, leaders, todo = set(), {0x200}, [0x200]
+    while todo:
+        pc = todo.pop()
+        if pc in reached or fetch(pc) is None:
+            continue
+        reached.add(pc)
+        ins = fetch(pc)
+        succ = successors(ins, pc)
+        if translate(ins, pc, mode) is None or len(succ) > 1 or ins >> 12 == 0x1:
+            leaders.update(succ)
+        todo.extend(succ)
+
+    def wait_loop(pc: int):
+        # delay timer wait loop (Fx07, 3x00, jump back), skipped by the interpreter in one step
+        ins = fetch(pc)
+        return (ins is not None and ins & 0xF0FF == 0xF007 and fetch(pc + 2) == 0x3000 | ins & 0xF00 and
+                fetch(pc + 4) == 0x1000 | pc)
+
+    funcs, blocks, mask = [], {}, bytearray((size + 7) // 8)
+    for start in sorted(leaders & reached):
+        if wait_loop(start):
+            continue
+        body, pc, end = [], start, None
+        while (len(body) < BLOCK_MAX and end is None and fetch(pc) is not None and
+               not (body and wait_loop(pc))):
+            t = translate(fetch(pc), pc, mode)
+            if t is None:
+                break
+            body.append((pc, t[0]))
+            end = t[1]
+            pc += 2
+        if not body:
+            continue
+        for b in range(start - 0x200, pc - 0x200):
+            mask[b // 8] |= 1 << b % 8
+        code = "".join(f"    // {p:03X}: {fetch(p):04X}\n" + "".join(f"    {s}\n" for s in stmts)
+                       for p, stmts in body)
+        next_pc = end if end is not None else f"0x{pc:03X}"
+        text = code + next_pc
+        uses = lambda var: re.search(rf"\b{var}\b", text) is not None
+        decl = []
+        if uses("v"):
+            decl.append("    uint8_t v[16];\n")
+        if uses("i"):
+            decl.append("    uint16_t i = *ip;\n")
+        if uses("f"):
+            decl.append("    uint8_t f;\n")
+        if uses("r"):
+            decl.append("    uint32_t r;\n")
+        if uses("v"):
+            decl.append("    memcpy(v, emu->v, sizeof(v));\n")
+        tail = [f"    const uint16_t pc = {next_pc};\n"]
+        if uses("v"):
+            tail.append("    memcpy(emu->v, v, sizeof(v));\n")
+        if uses("i"):
+            tail.append("    *ip = i;\n")
+        tail.append("    return pc;\n")
+        funcs.append(f"static uint16_t {name}_{start:03X}(OctEmu *emu, uint16_t *ip, const uint16_t keypad) {{\n" +
+                     "".join(decl) + code + "".join(tail) + "}\n")
+        blocks[start] = len(body)
+
+    entries = [f"    [0x{pc - 0x200:03X}] = {{{name}_{pc:03X}, {n}}},\n" for pc, n in sorted(blocks.items())]
+    mask_lines = [", ".join(f"0x{b:02X}" for b in mask[i:i + 16]) for i in range(0, len(mask), 16)]
+    return (
+        "\n".join(funcs) +
+        f"\nstatic const OctEmuBlock {name}_blocks[{size}] = {{\n" +
+        ("".join(entries) if entries else "    [0] = {NULL, 0},\n") + "};\n\n" +
+        f"static const uint8_t {name}_mask[] = {{\n    " + ",\n    ".join(mask_lines) + "\n};\n\n" +
+        f"static const OctEmuStaticCode {name} = {{\n"
+        f"    0x{rom_hash(data):016X}ULL, {MODES[mode]}, {size}, {name}_blocks, {name}_mask\n}};\n"
+    )
+
+
+if __name__ == "__main__":
+    import argparse
+
+    parser = argparse.ArgumentParser(description="Recompile CHIP-8 ROMs to C for OCTEMU_AOT builds")
+    parser.add_argument("-o", "--output", required=True, help="output C file")
+    parser.add_argument("roms", nargs="*", metavar="rom[:mode]", help="ROM file, mode chip8, schip or octo")
+    args = parser.parse_args()
+
+    units, names = [], []
+    for n, arg in enumerate(args.roms):
+        path, _, mode = arg.rpartition(":") if arg.rpartition(":")[2] in MODES else (arg, "", "octo")
+        with open(path, "rb") as f:
+            data = f.read()
+        assert 2 <= len(data) <= 0xE00, f"Invalid ROM size: {path}"
+        names.append(f"aot_rom{n}")
+        units.append(f"// {path.replace('*/', '')} ({mode})\n\n" + recompile(data, mode, names[-1]))
+
+    with open(args.output, "w") as f:
+        f.write(HEADER + "\n" + "\n".join(units) + "\n")
+        f.write("const OctEmuStaticCode *const octemu_aot_roms[] = {\n")
+        f.write("".join(f"    &{name},\n" for name in names) if names else "    NULL,\n")
+        f.write(f"}};\n\nconst unsigned int octemu_aot_roms_count = {len(names)};\n")
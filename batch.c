@@ -0,0 +1,257 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "batch.h"
+
+#define BATCH_DEFAULT_QUANTUM 8
+#define BATCH_MAX_THREADS 256
+#define BATCH_EMPTY UINT32_MAX
+#define BATCH_ABORT (UINT32_MAX - 1)
+
+/**
+ * Chase-Lev work-stealing deque of session indices. The owner pushes and takes
+ * at the bottom, thieves steal from the top. A session is in at most one deque
+ * at a time, so a capacity of the session count never overflows.
+ */
+typedef struct Deque {
+    _Alignas(64) atomic_size_t top;
+    _Alignas(64) atomic_size_t bottom;
+    atomic_uint_least32_t *buf;
+    size_t mask;
+} Deque;
+
+typedef struct Worker {
+    OctEmuBatch *batch;
+    Deque deque;
+    unsigned int id;
+    uint32_t rng; // victim selection
+} Worker;
+
+struct OctEmuBatch {
+    OctEmuSession **sessions;
+    size_t count, capacity;
+    unsigned int threads, quantum;
+    // set up for one octemu_batch_run()
+    unsigned int active;
+    Worker *workers;
+    atomic_size_t remaining; // unfinished sessions
+};
+
+static void deque_push(Deque *q, const uint32_t x) {
+    const size_t b = atomic_load_explicit(&q->bottom, memory_order_relaxed);
+    atomic_store_explicit(&q->buf[b & q->mask], x, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&q->bottom, b + 1, memory_order_relaxed);
+}
+
+static uint32_t deque_take(Deque *q) {
+    const size_t b = atomic_load_explicit(&q->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&q->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    size_t t = atomic_load_explicit(&q->top, memory_order_relaxed);
+    uint32_t x = BATCH_EMPTY;
+    if ((ptrdiff_t)(b - t) >= 0) {
+        x = atomic_load_explicit(&q->buf[b & q->mask], memory_order_relaxed);
+        if (b == t) { // last one, race against thieves
+            if (!atomic_compare_exchange_strong_explicit(&q->top, &t, t + 1, memory_order_seq_cst,
+                                                         memory_order_relaxed))
+                x = BATCH_EMPTY;
+            atomic_store_explicit(&q->bottom, b + 1, memory_order_relaxed);
+        }
+    } else
+        atomic_store_explicit(&q->bottom, b + 1, memory_order_relaxed);
+    return x;
+}
+
+static uint32_t deque_steal(Deque *q) {
+    size_t t = atomic_load_explicit(&q->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    const size_t b = atomic_load_explicit(&q->bottom, memory_order_acquire);
+    if ((ptrdiff_t)(b - t) <= 0)
+        return BATCH_EMPTY;
+    const uint32_t x = atomic_load_explicit(&q->buf[t & q->mask], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&q->top, &t, t + 1, memory_order_seq_cst,
+                                                 memory_order_relaxed))
+        return BATCH_ABORT;
+    return x;
+}
+
+OctEmuBatch *octemu_batch_new(const unsigned int threads) {
+    OctEmuBatch *batch = calloc(1, sizeof(OctEmuBatch));
+    if (!batch) {
+        fputs("Failed to create OctEmuBatch\n", stderr);
+        return NULL;
+    }
+    batch->threads = threads;
+    if (!batch->threads) {
+        const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        batch->threads = cpus > 0 ? cpus : 1;
+    }
+    if (batch->threads > BATCH_MAX_THREADS)
+        batch->threads = BATCH_MAX_THREADS;
+    return batch;
+}
+
+void octemu_batch_free(OctEmuBatch *batch) {
+    for (size_t n = 0; n < batch->count; n++) {
+        octemu_free(batch->sessions[n]->emu);
+        free(batch->sessions[n]);
+    }
+    free(batch->sessions);
+    free(batch);
+}
+
+OctEmuSession *octemu_batch_add(OctEmuBatch *batch, const OctEmuMode mode,
+                                const uint8_t *rom_data, const size_t size,
+                                const unsigned int tickrate, const unsigned long max_frames) {
+    if (batch->count >= BATCH_ABORT) {
+        fputs("Too many sessions\n", stderr);
+        return NULL;
+    }
+    if (batch->count == batch->capacity) {
+        const size_t capacity = batch->capacity ? batch->capacity * 2 : 64;
+        OctEmuSession **sessions = realloc(batch->sessions, capacity * sizeof(OctEmuSession *));
+        if (!sessions)
+            return NULL;
+        batch->sessions = sessions;
+        batch->capacity = capacity;
+    }
+    OctEmuSession *s = calloc(1, sizeof(OctEmuSession));
+    if (!s)
+        return NULL;
+    s->emu = octemu_new(mode);
+    if (!s->emu || octemu_set_rom(s->emu, rom_data, size)) {
+        if (s->emu)
+            octemu_free(s->emu);
+        free(s);
+        return NULL;
+    }
+    s->tickrate = tickrate;
+    s->max_frames = max_frames;
+    batch->sessions[batch->count++] = s;
+    return s;
+}
+
+size_t octemu_batch_count(const OctEmuBatch *batch) { return batch->count; }
+
+OctEmuSession *octemu_batch_session(OctEmuBatch *batch, const size_t index) {
+    return index < batch->count ? batch->sessions[index] : NULL;
+}
+
+// run up to quantum frames, returns true if the session finished
+static bool step_session(OctEmuSession *s, const unsigned int quantum) {
+    for (unsigned int q = 0; q < quantum; q++) {
+        if (s->frames >= s->max_frames) {
+            s->stop = OCTEMU_STOP_BUDGET;
+            return true;
+        }
+        const uint16_t keypad = s->input ? s->input(s->user, s->emu, s->frames) : 0;
+        const OctEmuRunResult res = octemu_run(s->emu, s->tickrate, keypad);
+        if (res.stop == OCTEMU_STOP_ERROR) {
+            s->stop = res.stop;
+            return true;
+        }
+        octemu_tick(s->emu);
+        const uint64_t dirty = octemu_take_gfx_dirty(s->emu);
+        const int end = s->sink && s->sink(s->user, s->emu, s->frames, dirty);
+        s->frames++;
+        if (res.stop == OCTEMU_STOP_EXIT || end) {
+            s->stop = end ? OCTEMU_STOP_BUDGET : res.stop;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void *worker_loop(void *arg) {
+    Worker *w = arg;
+    OctEmuBatch *batch = w->batch;
+    unsigned int idle = 0;
+    while (atomic_load_explicit(&batch->remaining, memory_order_acquire)) {
+        uint32_t x = deque_take(&w->deque);
+        // own deque empty: steal from random victims
+        for (unsigned int tries = 0; x >= BATCH_ABORT && tries < batch->active * 2; tries++) {
+            w->rng = w->rng * 1103515245 + 12345;
+            const unsigned int victim = (w->rng >> 16) % batch->active;
+            if (victim != w->id)
+                x = deque_steal(&batch->workers[victim].deque);
+        }
+        if (x >= BATCH_ABORT) { // the rest is running elsewhere
+            if (++idle > 1024)
+                usleep(100);
+            else if (idle > 16)
+                sched_yield();
+            continue;
+        }
+        idle = 0;
+        OctEmuSession *s = batch->sessions[x];
+        if (step_session(s, batch->quantum)) {
+            s->finished = true;
+            atomic_fetch_sub_explicit(&batch->remaining, 1, memory_order_acq_rel);
+        } else
+            deque_push(&w->deque, x);
+    }
+    return NULL;
+}
+
+int octemu_batch_run(OctEmuBatch *batch, const unsigned int quantum) {
+    size_t capacity = 1, pending = 0;
+    while (capacity < batch->count)
+        capacity <<= 1;
+    for (size_t n = 0; n < batch->count; n++)
+        pending += !batch->sessions[n]->finished;
+    if (!pending)
+        return 0;
+
+    int ret = 1;
+    unsigned int threads = batch->threads, started = 0;
+    if (threads > pending)
+        threads = pending;
+    pthread_t tids[BATCH_MAX_THREADS];
+    batch->workers = calloc(threads, sizeof(Worker));
+    if (!batch->workers)
+        return 1;
+    batch->active = threads;
+    batch->quantum = quantum ? quantum : BATCH_DEFAULT_QUANTUM;
+    for (unsigned int t = 0; t < threads; t++) {
+        Worker *w = &batch->workers[t];
+        w->batch = batch;
+        w->id = t;
+        w->rng = t + 1;
+        w->deque.mask = capacity - 1;
+        w->deque.buf = calloc(capacity, sizeof(atomic_uint_least32_t));
+        if (!w->deque.buf)
+            goto out;
+    }
+    // deal the sessions round-robin, stealing evens out the rest
+    for (size_t n = 0, t = 0; n < batch->count; n++) {
+        if (!batch->sessions[n]->finished)
+            deque_push(&batch->workers[t++ % threads].deque, n);
+    }
+    atomic_store(&batch->remaining, pending);
+
+    for (; started < threads; started++) {
+        if (pthread_create(&tids[started], NULL, worker_loop, &batch->workers[started]))
+            break;
+    }
+    if (started < threads) {
+        fputs("Failed to start worker threads\n", stderr);
+        if (!started)
+            goto out;
+    }
+    // sessions dealt to threads that failed to start get stolen by the others
+    for (unsigned int t = 0; t < started; t++)
+        pthread_join(tids[t], NULL);
+    ret = 0;
+
+out:
+    for (unsigned int t = 0; t < threads; t++)
+        free(batch->workers[t].deque.buf);
+    free(batch->workers);
+    batch->workers = NULL;
+    return ret;
+}
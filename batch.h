@@ -0,0 +1,73 @@
+#ifndef _OCTEMU_BATCH_H_
+#define _OCTEMU_BATCH_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "core.h"
+
+/**
+ * Called before every frame of a session.
+ * @param frame Index of the frame about to run
+ * @return Keypad state bitmask for the frame
+ */
+typedef uint16_t (*OctEmuInputFunc)(void *user, const OctEmu *emu, const unsigned long frame);
+
+/**
+ * Called after every frame of a session (after timers ticked).
+ * @param dirty Rows changed during the frame, already taken from the emulator
+ * @return 0 to continue, nonzero to end the session
+ */
+typedef int (*OctEmuFrameFunc)(void *user, const OctEmu *emu, const unsigned long frame,
+                               const uint64_t dirty);
+
+typedef struct OctEmuSession {
+    OctEmu *emu;            // owned by the batch
+    unsigned int tickrate;  // instructions per frame
+    unsigned long max_frames;
+    // optional, called from worker threads but never concurrently for one session
+    OctEmuInputFunc input;  // keypad is 0 if NULL
+    OctEmuFrameFunc sink;
+    void *user;
+    // results, valid after octemu_batch_run()
+    bool finished;
+    unsigned long frames;   // frames executed
+    OctEmuStop stop;        // OCTEMU_STOP_BUDGET if max_frames was reached or the sink ended it
+} OctEmuSession;
+
+// Sessions stepped by a pool of threads (opaque)
+typedef struct OctEmuBatch OctEmuBatch;
+
+/**
+ * Create an empty batch.
+ * @param threads Worker threads, 0 for one per online CPU
+ */
+OctEmuBatch *octemu_batch_new(const unsigned int threads);
+
+/* Free the batch, including the emulators of all sessions. */
+void octemu_batch_free(OctEmuBatch *);
+
+/**
+ * Create an emulator for rom_data and add it as a session. The ROM is used with
+ * octemu_set_rom(), so one buffer can be shared by any number of sessions and
+ * must outlive the batch. Set input/sink/user on the returned session as needed.
+ * @return The new session, NULL on failure
+ */
+OctEmuSession *octemu_batch_add(OctEmuBatch *, const OctEmuMode mode,
+                                const uint8_t *rom_data, const size_t size,
+                                const unsigned int tickrate, const unsigned long max_frames);
+
+size_t octemu_batch_count(const OctEmuBatch *);
+OctEmuSession *octemu_batch_session(OctEmuBatch *, const size_t index);
+
+/**
+ * Run all unfinished sessions to completion and wait for them. Sessions are
+ * stepped quantum frames at a time; idle workers steal pending sessions from
+ * busy ones, so sessions that end early do not leave threads idle.
+ * @param quantum Frames run per scheduling step (0 for the default)
+ * @return 0 on success, 1 if worker threads could not be started
+ */
+int octemu_batch_run(OctEmuBatch *, const unsigned int quantum);
+
+#endif // _OCTEMU_BATCH_H_
@@ -0,0 +1,232 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../core.h"
+#include "rom_config.h"
+
+#ifndef OCTEMU_VERSION
+#define OCTEMU_VERSION "dev"
+#endif
+
+extern const OctEmuRom emu_roms[];
+extern const unsigned int emu_roms_count;
+
+typedef struct Result {
+    uint64_t cycles, draws;
+    double seconds, draw_share;
+    unsigned int exits;
+    bool error;
+} Result;
+
+static inline OctEmuMode str2mode(const char *mode_str) {
+    if (!strcmp(mode_str, "chip8"))
+        return OCTEMU_MODE_CHIP8;
+    else if (!strcmp(mode_str, "schip"))
+        return OCTEMU_MODE_SCHIP;
+    else
+        return OCTEMU_MODE_OCTO;
+}
+
+static inline double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// deterministic input: every 8 frames one pseudo random key is held for 4 frames
+static inline uint16_t bench_keypad(const unsigned int frame) {
+    if (frame & 4)
+        return 0;
+    uint32_t x = (frame >> 3) * 2654435761u;
+    x ^= x >> 16;
+    return 1 << (x & 0xF);
+}
+
+// run frames of one ROM, returns executed instructions, -1 on error
+static int64_t run_frames(OctEmu *emu, const OctEmuRom *rom, const unsigned int frames,
+                          unsigned int *exits) {
+    int64_t cycles = 0;
+    octemu_set_seed(emu, 1);
+    octemu_reset(emu);
+    for (unsigned int frame = 0; frame < frames; frame++) {
+        const OctEmuRunResult res = octemu_run(emu, rom->tickrate, bench_keypad(frame));
+        cycles += res.cycles;
+        if (res.stop == OCTEMU_STOP_ERROR)
+            return -1;
+        if (res.stop == OCTEMU_STOP_EXIT) { // restart, keep the workload going
+            octemu_reset(emu);
+            (*exits)++;
+        }
+        octemu_take_gfx_dirty(emu);
+        octemu_tick(emu);
+    }
+    return cycles;
+}
+
+static Result bench_rom(OctEmu *emu, const OctEmuRom *rom, const unsigned int frames,
+                        const unsigned int repeats) {
+    Result r = {0};
+    if (octemu_set_mode(emu, str2mode(rom->mode)) ||
+        octemu_set_rom(emu, rom->data, rom->length)) {
+        r.error = true;
+        return r;
+    }
+#ifdef OCTEMU_AOT
+    octemu_set_static_code(emu, rom->code);
+#endif
+
+    // throughput: best of repeats without Dxyn timing
+    emu->profile.enabled = false;
+    for (unsigned int rep = 0; rep < repeats; rep++) {
+        unsigned int exits = 0;
+        const double start = now_seconds();
+        const int64_t cycles = run_frames(emu, rom, frames, &exits);
+        const double seconds = now_seconds() - start;
+        if (cycles < 0) {
+            r.error = true;
+            break;
+        }
+        if (!rep || seconds < r.seconds) {
+            r.seconds = seconds;
+            r.cycles = cycles;
+            r.exits = exits;
+        }
+    }
+
+    // Dxyn share: one more run with timestamps around each draw
+    if (!r.error) {
+        unsigned int exits = 0;
+        emu->profile.enabled = true;
+        emu->profile.draws = emu->profile.draw_ticks = 0;
+        const uint64_t start = octemu_profile_clock();
+        run_frames(emu, rom, frames, &exits);
+        const uint64_t total = octemu_profile_clock() - start;
+        emu->profile.enabled = false;
+        r.draws = emu->profile.draws;
+        r.draw_share = total ? (double)emu->profile.draw_ticks / total : 0;
+    }
+    octemu_clear_rom(emu);
+    return r;
+}
+
+static void print_usage(const char *argv0) {
+    printf("Usage: %s [option...] [rom_title...]\n\nOPTIONS\n", argv0);
+    puts("-n <uint>\tvirtual frames per ROM (default 3000)");
+    puts("-r <uint>\trepeats, the fastest one is reported (default 3)");
+    puts("-f csv|json\toutput format (default csv)");
+    puts("-l\t\tlist embedded ROMs and exit");
+    puts("-v\t\tprint version and exit\n");
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    unsigned int frames = 3000, repeats = 3;
+    bool json = false;
+    while ((opt = getopt(argc, argv, "n:r:f:lv?h")) != -1) {
+        switch (opt) {
+        case 'n':
+            frames = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            repeats = strtoul(optarg, NULL, 10);
+            if (!repeats)
+                repeats = 1;
+            break;
+        case 'f':
+            if (!strcmp(optarg, "json"))
+                json = true;
+            else if (strcmp(optarg, "csv")) {
+                fputs("Invalid format\n", stderr);
+                print_usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'l':
+            for (unsigned int i = 0; i < emu_roms_count; i++)
+                printf("%s\t%s\t%u\n", emu_roms[i].title, emu_roms[i].mode, emu_roms[i].tickrate);
+            return 0;
+        case 'v':
+            puts("octemu " OCTEMU_VERSION);
+            return 0;
+        case '?':
+        case 'h':
+            print_usage(argv[0]);
+            return 0;
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    OctEmu *emu = octemu_new(OCTEMU_MODE_OCTO);
+    if (!emu)
+        return 1;
+#ifdef OCTEMU_JIT
+    octemu_set_jit(emu, true); // one emulator, the code memory does not matter here
+#endif
+    octemu_set_idle_skip(emu, false); // count executed instructions only, as before idle skipping
+
+    if (json)
+        printf("{\"version\": \"%s\", \"frames\": %u, \"roms\": [", OCTEMU_VERSION, frames);
+    else
+        puts("rom,mode,tickrate,instructions,seconds,ips,ns_per_insn,draws,draw_share,exits");
+
+    int ret = 0;
+    uint64_t total_cycles = 0;
+    double total_seconds = 0, total_draw_seconds = 0;
+    bool first = true;
+    for (unsigned int i = 0; i < emu_roms_count; i++) {
+        const OctEmuRom *rom = &emu_roms[i];
+        if (optind < argc) { // only ROMs named on the command line
+            int k = optind;
+            while (k < argc && strcmp(argv[k], rom->title))
+                k++;
+            if (k == argc)
+                continue;
+        }
+        const Result r = bench_rom(emu, rom, frames, repeats);
+        if (r.error) {
+            fprintf(stderr, "%s: emulator error\n", rom->title);
+            ret = 1;
+            continue;
+        }
+        const double ips = r.seconds ? r.cycles / r.seconds : 0;
+        const double ns = r.cycles ? r.seconds * 1e9 / r.cycles : 0;
+        total_cycles += r.cycles;
+        total_seconds += r.seconds;
+        total_draw_seconds += r.seconds * r.draw_share;
+        if (json)
+            printf("%s\n  {\"rom\": \"%s\", \"mode\": \"%s\", \"tickrate\": %u, \"instructions\": %llu, "
+                   "\"seconds\": %.6f, \"ips\": %.0f, \"ns_per_insn\": %.3f, \"draws\": %llu, "
+                   "\"draw_share\": %.4f, \"exits\": %u}",
+                   first ? "" : ",", rom->title, rom->mode, rom->tickrate,
+                   (unsigned long long)r.cycles, r.seconds, ips, ns, (unsigned long long)r.draws,
+                   r.draw_share, r.exits);
+        else
+            printf("\"%s\",%s,%u,%llu,%.6f,%.0f,%.3f,%llu,%.4f,%u\n", rom->title, rom->mode,
+                   rom->tickrate, (unsigned long long)r.cycles, r.seconds, ips, ns,
+                   (unsigned long long)r.draws, r.draw_share, r.exits);
+        first = false;
+        fflush(stdout);
+    }
+
+    // totals over all ROMs, draw share weighted by run time
+    const double ips = total_seconds ? total_cycles / total_seconds : 0;
+    const double ns = total_cycles ? total_seconds * 1e9 / total_cycles : 0;
+    const double share = total_seconds ? total_draw_seconds / total_seconds : 0;
+    if (json)
+        printf("\n], \"total\": {\"instructions\": %llu, \"seconds\": %.6f, \"ips\": %.0f, "
+               "\"ns_per_insn\": %.3f, \"draw_share\": %.4f}}\n",
+               (unsigned long long)total_cycles, total_seconds, ips, ns, share);
+    else
+        printf("\"TOTAL\",,,%llu,%.6f,%.0f,%.3f,,%.4f,,\n",
+               (unsigned long long)total_cycles, total_seconds, ips, ns, share);
+
+    octemu_free(emu);
+    return ret;
+}
@@ -0,0 +1,214 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../core.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define CLOCK_UNIT "tsc"
+static inline uint64_t bench_clock() { return __rdtsc(); }
+#else
+#include <time.h>
+#define CLOCK_UNIT "ns"
+static inline uint64_t bench_clock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#endif
+
+#ifndef OCTEMU_VERSION
+#define OCTEMU_VERSION "dev"
+#endif
+
+// the program is COPIES times the instruction under test, then a jump back to 0x200
+#define COPIES 64
+#define BASELINE_INS 0x8000 // mov v0, v0, never fused with the next one
+
+typedef struct Case {
+    const char *kernel, *name;
+    OctEmuMode mode;
+    bool hires;
+    uint16_t ins;
+    uint8_t vx, vy; // v0, v1
+    uint16_t i;
+} Case;
+
+static const char *mode_names[] = {"chip8", "schip", "octo"};
+
+static Case cases[128];
+static unsigned int cases_count = 0;
+
+static void add_case(const char *kernel, const char *name, const OctEmuMode mode, const bool hires,
+                     const uint16_t ins, const uint8_t vx, const uint8_t vy, const uint16_t i) {
+    cases[cases_count++] = (Case){kernel, name, mode, hires, ins, vx, vy, i};
+}
+
+static void add_draw_cases(const char *kernel, const bool hires, const uint16_t ins) {
+    static const char *offset_names[] = {"x+0", "x+1", "x+2", "x+3", "x+4", "x+5", "x+6", "x+7"};
+    static const char *span_names[] = {"span+0", "span+1", "span+2", "span+3",
+                                       "span+4", "span+5", "span+6", "span+7"};
+    const uint8_t width = hires ? OCTEMU_GFX_WIDTH : OCTEMU_GFX_WIDTH / 2;
+    const uint8_t height = hires ? OCTEMU_GFX_HEIGHT : OCTEMU_GFX_HEIGHT / 2;
+    // every sub-byte x offset, inside a word and (hires) across the two row words
+    for (uint8_t off = 0; off < 8; off++)
+        add_case(kernel, offset_names[off], OCTEMU_MODE_SCHIP, hires, ins, 8 + off, 4, 0);
+    if (hires) {
+        for (uint8_t off = 0; off < 8; off++)
+            add_case(kernel, span_names[off], OCTEMU_MODE_SCHIP, hires, ins, 56 + off, 4, 0);
+    }
+    // bottom right corner: clipped in schip mode, wrapped in octo mode
+    add_case(kernel, "clipped", OCTEMU_MODE_SCHIP, hires, ins, width - 4, height - 4, 0);
+    add_case(kernel, "wrapped", OCTEMU_MODE_OCTO, hires, ins, width - 4, height - 4, 0);
+}
+
+static void init_cases() {
+    add_draw_cases("draw8lr", false, 0xD018);
+    add_draw_cases("draw16lr", false, 0xD010);
+    add_draw_cases("draw8hr", true, 0xD018);
+    add_draw_cases("draw16hr", true, 0xD010);
+    for (int hires = 0; hires < 2; hires++) {
+        const char *name = hires ? "hires" : "lowres";
+        add_case("00Cn", name, OCTEMU_MODE_SCHIP, hires, 0x00C4, 0, 0, 0);
+        add_case("00FB", name, OCTEMU_MODE_SCHIP, hires, 0x00FB, 0, 0, 0);
+        add_case("00FC", name, OCTEMU_MODE_SCHIP, hires, 0x00FC, 0, 0, 0);
+        add_case("00E0", name, OCTEMU_MODE_SCHIP, hires, 0x00E0, 0, 0, 0);
+    }
+    // memory ops on a buffer away from the program, I is not incremented in schip mode
+    add_case("Fx33", "v0=255", OCTEMU_MODE_SCHIP, false, 0xF033, 255, 0, 0xE00);
+    add_case("Fx55", "v0..vF", OCTEMU_MODE_SCHIP, false, 0xFF55, 0, 0, 0xE00);
+    add_case("Fx65", "v0..vF", OCTEMU_MODE_SCHIP, false, 0xFF65, 0, 0, 0xE00);
+}
+
+static int load_program(OctEmu *emu, const Case *c, const uint16_t ins) {
+    uint8_t prog[COPIES * 2 + 2];
+    for (int k = 0; k < COPIES; k++) {
+        prog[k * 2] = ins >> 8;
+        prog[k * 2 + 1] = ins & 0xFF;
+    }
+    prog[COPIES * 2] = 0x12; // jp 0x200
+    prog[COPIES * 2 + 1] = 0x00;
+    if (emu->rom)
+        octemu_clear_rom(emu);
+    if (octemu_set_mode(emu, c->mode) || octemu_load_rom(emu, prog, sizeof(prog)))
+        return 1;
+    octemu_reset(emu);
+    emu->hires = c->hires;
+    emu->v[0] = c->vx;
+    emu->v[1] = c->vy;
+    emu->i = c->i;
+    return 0;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    const uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// median and minimum clock ticks of one run of cycles instructions, -1 on error
+static int measure(OctEmu *emu, const Case *c, const uint16_t ins, const unsigned int cycles,
+                   const unsigned int warmup, const unsigned int repeats, uint64_t *median, uint64_t *min) {
+    uint64_t samples[repeats];
+    if (load_program(emu, c, ins))
+        return -1;
+    for (unsigned int rep = 0; rep < warmup + repeats; rep++) {
+        const uint64_t start = bench_clock();
+        const OctEmuRunResult res = octemu_run(emu, cycles, 0);
+        const uint64_t end = bench_clock();
+        if (res.stop != OCTEMU_STOP_BUDGET)
+            return -1;
+        if (rep >= warmup)
+            samples[rep - warmup] = end - start;
+    }
+    qsort(samples, repeats, sizeof(uint64_t), cmp_u64);
+    *median = samples[repeats / 2];
+    *min = samples[0];
+    return 0;
+}
+
+static void print_usage(const char *argv0) {
+    printf("Usage: %s [option...] [kernel...]\n\nOPTIONS\n", argv0);
+    printf("-n <uint>\tinstructions per timed run (default %d)\n", (COPIES + 1) * 1000);
+    puts("-w <uint>\twarm-up runs (default 3)");
+    puts("-r <uint>\ttimed runs, median and minimum are reported (default 15)");
+    puts("-v\t\tprint version and exit\n");
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    unsigned int cycles = (COPIES + 1) * 1000, warmup = 3, repeats = 15;
+    while ((opt = getopt(argc, argv, "n:w:r:v?h")) != -1) {
+        switch (opt) {
+        case 'n':
+            cycles = strtoul(optarg, NULL, 10);
+            break;
+        case 'w':
+            warmup = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            repeats = strtoul(optarg, NULL, 10);
+            break;
+        case 'v':
+            puts("octemu " OCTEMU_VERSION);
+            return 0;
+        case '?':
+        case 'h':
+            print_usage(argv[0]);
+            return 0;
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    // whole loop iterations only, so every run executes the same instructions
+    cycles -= cycles % (COPIES + 1);
+    if (!cycles || !repeats) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    const double ops = (double)cycles / (COPIES + 1) * COPIES;
+
+    OctEmu *emu = octemu_new(OCTEMU_MODE_SCHIP);
+    if (!emu)
+        return 1;
+    octemu_set_idle_skip(emu, false); // the baseline and Fx65 loops do not change the state
+    init_cases();
+
+    // dispatch cost of a trivial instruction per mode, subtracted from every case
+    double baseline[3] = {-1, -1, -1};
+
+    printf("kernel,case,mode,%s_per_op_median,%s_per_op_min\n", CLOCK_UNIT, CLOCK_UNIT);
+    int ret = 0;
+    for (unsigned int n = 0; n < cases_count; n++) {
+        const Case *c = &cases[n];
+        if (optind < argc) { // only kernels named on the command line
+            int k = optind;
+            while (k < argc && strcmp(argv[k], c->kernel))
+                k++;
+            if (k == argc)
+                continue;
+        }
+        uint64_t median, min;
+        if (baseline[c->mode] < 0) {
+            if (measure(emu, c, BASELINE_INS, cycles, warmup, repeats, &median, &min)) {
+                ret = 1;
+                break;
+            }
+            baseline[c->mode] = median / ops;
+        }
+        if (measure(emu, c, c->ins, cycles, warmup, repeats, &median, &min)) {
+            fprintf(stderr, "%s %s: emulator error\n", c->kernel, c->name);
+            ret = 1;
+            continue;
+        }
+        printf("%s,%s,%s,%.2f,%.2f\n", c->kernel, c->name, mode_names[c->mode],
+               median / ops - baseline[c->mode], min / ops - baseline[c->mode]);
+    }
+
+    octemu_free(emu);
+    return ret;
+}
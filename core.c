@@ -6,14 +6,25 @@
 
 #include "core.h"
 
+#ifdef OCTEMU_PROFILE
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+uint64_t octemu_profile_clock(void) { return __rdtsc(); }
+#else
+#include <time.h>
+uint64_t octemu_profile_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#endif
+#endif
+
 #define ins_x ((ins & 0xF00) >> 8)
 #define ins_y ((ins & 0xF0) >> 4)
 #define ins_n (ins & 0xF)
 #define ins_nn (ins & 0xFF)
 #define ins_nnn (ins & 0xFFF)
-#define chip8_mode (emu->mode == OCTEMU_MODE_CHIP8)
-#define schip_mode (emu->mode == OCTEMU_MODE_SCHIP)
-#define octo_mode (emu->mode == OCTEMU_MODE_OCTO)
 
 const uint8_t OctEmu_Keypad[16] = {
     0x1, 0x2, 0x3, 0xC,
@@ -22,7 +33,53 @@ const uint8_t OctEmu_Keypad[16] = {
     0xA, 0x0, 0xB, 0xF
 };
 
-static const uint8_t sprites[80] = {
+struct OctEmuInsn {
+    uint8_t op, x, y, n, nn;
+    uint8_t base; // op of the first instruction of a fused op, see fuse()
+    uint16_t nnn;
+};
+
+enum {
+    OP_NONE = 0, // not decoded yet
+    OP_INVALID,
+    OP_BAD_PC, // sentinel past the last instruction, see OCTEMU_PC_FAULT
+    OP_EXIT,
+    OP_SCD, OP_CLS, OP_RET, OP_SCR, OP_SCL, OP_LOW, OP_HIGH,
+    OP_JP, OP_CALL, OP_SE_NN, OP_SNE_NN, OP_SE_VY, OP_MOV_NN, OP_ADD_NN,
+    OP_MOV, OP_OR, OP_AND, OP_XOR, OP_ADD, OP_SUB, OP_SHR, OP_SUBN, OP_SHL,
+    OP_SNE_VY, OP_MOV_I, OP_JP_V0, OP_RND, OP_DRW,
+    OP_SKP, OP_SKNP,
+    OP_MOV_DT_TO, OP_MOV_KEY, OP_MOV_DT, OP_MOV_ST, OP_ADD_I, OP_SPRITE, OP_SPRITE_HR,
+    OP_BCD, OP_STORE, OP_LOAD, OP_STORE_RPL, OP_LOAD_RPL,
+    OP_HCF,
+    // fused sequences, see fuse()
+    OP_ADD_SE, OP_ADD_SNE, OP_MOV_MOV, OP_MOV_I_DRW, OP_WAIT_DT
+};
+
+/*
+ * Instructions can start at 0x200-0xFFE. The entries after them are OP_BAD_PC sentinels
+ * that report a PC fault when fetched, so PCs stepping forward need no bounds check.
+ * Jumps to invalid addresses park the PC at OCTEMU_PC_FAULT, which forward steps from
+ * valid PCs (at most +4) cannot reach, and keep the real target for the report.
+ */
+#define OCTEMU_PC_FAULT 0x1003
+#define OCTEMU_DECODED_SIZE (OCTEMU_PC_FAULT + 1 - 0x200)
+#define OCTEMU_DECODED_PCS (OCTEMU_MEM_SIZE - 1 - 0x200) // entries that can hold instructions
+
+typedef OctEmuRunResult (*run_func)(OctEmu *, const unsigned int, const uint16_t);
+static inline run_func get_run_func(const OctEmuMode mode);
+
+#ifdef OCTEMU_JIT
+static void jit_flush(OctEmu *);
+static void jit_invalidate(OctEmu *, const uint16_t addr, const uint16_t len);
+#endif
+
+// memory page 0x000-0x0FF: small fonts, big fonts, then zeros
+static const struct {
+    uint8_t lr[80];
+    uint8_t hr[160]; // Octo's 0-F big fonts
+    uint8_t pad[OCTEMU_PAGE_SIZE - 240];
+} fonts = {{
     0x60, 0xA0, 0xA0, 0xA0, 0xC0,
     0x40, 0xC0, 0x40, 0x40, 0xE0,
     0xC0, 0x20, 0x40, 0x80, 0xE0,
@@ -39,9 +96,7 @@ static const uint8_t sprites[80] = {
     0xC0, 0xA0, 0xA0, 0xA0, 0xC0,
     0xE0, 0x80, 0xC0, 0x80, 0xE0,
     0xE0, 0x80, 0xC0, 0x80, 0x80,
-};
-
-static const uint8_t sprites_hr[160] = { // Octo's 0-F big fonts
+}, {
     0x7C, 0xC6, 0xCE, 0xDE, 0xD6, 0xF6, 0xE6, 0xC6, 0x7C, 0x00,
     0x10, 0x30, 0xF0, 0x30, 0x30, 0x30, 0x30, 0x30, 0xFC, 0x00,
     0x78, 0xCC, 0xCC, 0x0C, 0x18, 0x30, 0x60, 0xCC, 0xFC, 0x00,
@@ -58,48 +113,414 @@ static const uint8_t sprites_hr[160] = { // Octo's 0-F big fonts
     0xF8, 0x6C, 0x66, 0x66, 0x66, 0x66, 0x66, 0x6C, 0xF8, 0x00,
     0xFE, 0x62, 0x60, 0x64, 0x7C, 0x64, 0x60, 0x62, 0xFE, 0x00,
     0xFE, 0x66, 0x62, 0x64, 0x7C, 0x64, 0x60, 0x60, 0xF0, 0x00
-};
+}};
+
+// xorshift32 state of a seed: a bijective mix, so nearby seeds give unrelated sequences
+static inline uint32_t seed_state(uint32_t x) {
+    x += 0x9E3779B9;
+    x = (x ^ x >> 16) * 0x85EBCA6B;
+    x = (x ^ x >> 13) * 0xC2B2AE35;
+    x ^= x >> 16;
+    return x ? x : 1; // 0 is the one state xorshift never leaves
+}
+
+static inline uint8_t next_random(uint32_t *state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x >> 24;
+}
+
+#ifdef OCTEMU_PAGED_MEM
+static const uint8_t zero_page[OCTEMU_PAGE_SIZE];
+
+static inline uint8_t mem_get(const OctEmu *emu, const uint16_t addr) {
+    return emu->pages[addr / OCTEMU_PAGE_SIZE][addr % OCTEMU_PAGE_SIZE];
+}
+
+// private copy of page p for writing, NULL if it cannot be allocated
+static uint8_t *private_page(OctEmu *emu, const uint8_t p) {
+    uint8_t *page = emu->private_pages[p];
+    if (emu->pages[p] == page)
+        return page;
+    if (!page && !(page = emu->private_pages[p] = malloc(OCTEMU_PAGE_SIZE))) {
+        fputs("Failed to allocate memory page\n", stderr);
+        return NULL;
+    }
+    memcpy(page, emu->pages[p], OCTEMU_PAGE_SIZE);
+    emu->pages[p] = page;
+    return page;
+}
+
+static void mem_read(const OctEmu *emu, uint16_t addr, uint8_t *dst, uint16_t len) {
+    while (len) {
+        const uint16_t offset = addr % OCTEMU_PAGE_SIZE;
+        const uint16_t n = len < OCTEMU_PAGE_SIZE - offset ? len : OCTEMU_PAGE_SIZE - offset;
+        memcpy(dst, emu->pages[addr / OCTEMU_PAGE_SIZE] + offset, n);
+        addr += n;
+        dst += n;
+        len -= n;
+    }
+}
+
+static int mem_write(OctEmu *emu, uint16_t addr, const uint8_t *src, uint16_t len) {
+    while (len) {
+        const uint16_t offset = addr % OCTEMU_PAGE_SIZE;
+        const uint16_t n = len < OCTEMU_PAGE_SIZE - offset ? len : OCTEMU_PAGE_SIZE - offset;
+        uint8_t *page = private_page(emu, addr / OCTEMU_PAGE_SIZE);
+        if (!page)
+            return 1;
+        memcpy(page + offset, src, n);
+        addr += n;
+        src += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void free_private_pages(OctEmu *emu) {
+    for (int p = 0; p < OCTEMU_MEM_PAGES; p++) {
+        free(emu->private_pages[p]);
+        emu->private_pages[p] = NULL;
+    }
+}
+
+// page p above 0x200 after reset: the ROM, or a copy of its unpadded last page
+static void map_rom_page(OctEmu *emu, const uint8_t p) {
+    const int offset = p * OCTEMU_PAGE_SIZE - 0x200;
+    if (offset >= emu->rom_size) {
+        emu->pages[p] = zero_page;
+    } else if (offset + OCTEMU_PAGE_SIZE <= emu->rom_size || emu->rom_padded) {
+        emu->pages[p] = emu->rom + offset;
+    } else { // allocated by alloc_rom_tail()
+        uint8_t *page = emu->private_pages[p];
+        memcpy(page, emu->rom + offset, emu->rom_size - offset);
+        memset(page + emu->rom_size - offset, 0, OCTEMU_PAGE_SIZE - (emu->rom_size - offset));
+        emu->pages[p] = page;
+    }
+}
+
+// map every page to the memory after reset, written pages are kept for reuse
+static void map_image(OctEmu *emu) {
+    emu->pages[0] = (const uint8_t *)&fonts;
+    for (uint8_t p = 1; p < 0x200 / OCTEMU_PAGE_SIZE; p++)
+        emu->pages[p] = zero_page;
+    for (uint8_t p = 0x200 / OCTEMU_PAGE_SIZE; p < OCTEMU_MEM_PAGES; p++)
+        map_rom_page(emu, p);
+}
+
+// an external ROM ending inside a page cannot be mapped there, its last page is copied
+static int alloc_rom_tail(OctEmu *emu) {
+    const uint8_t p = (0x200 + emu->rom_size) / OCTEMU_PAGE_SIZE;
+    if (emu->rom_padded || !(emu->rom_size % OCTEMU_PAGE_SIZE) || emu->private_pages[p])
+        return 0;
+    if (!(emu->private_pages[p] = malloc(OCTEMU_PAGE_SIZE))) {
+        fputs("Failed to allocate memory page\n", stderr);
+        return 1;
+    }
+    return 0;
+}
+#else
+static inline uint8_t mem_get(const OctEmu *emu, const uint16_t addr) { return emu->mem[addr]; }
+
+static inline void mem_read(const OctEmu *emu, const uint16_t addr, uint8_t *dst, const uint16_t len) {
+    memcpy(dst, emu->mem + addr, len);
+}
+
+static inline int mem_write(OctEmu *emu, const uint16_t addr, const uint8_t *src, const uint16_t len) {
+    memcpy(emu->mem + addr, src, len);
+    return 0;
+}
+#endif
+
+#ifdef OCTEMU_AOT
+// static code runs while it was compiled for this ROM and mode and its instructions are in memory
+static void check_static_code(OctEmu *emu) {
+    const OctEmuStaticCode *code = emu->static_code;
+    emu->static_active = false;
+    if (!code || code->mode != emu->mode || code->rom_size != emu->rom_size ||
+        code->rom_hash != octemu_rom_hash(emu))
+        return;
+    for (uint16_t n = 0; n < code->rom_size; n++) {
+        if (code->code_mask[n / 8] >> n % 8 & 1 && mem_get(emu, 0x200 + n) != emu->rom[n])
+            return;
+    }
+    emu->static_active = true;
+}
+
+int octemu_set_static_code(OctEmu *emu, const OctEmuStaticCode *code) {
+    emu->static_code = code;
+    check_static_code(emu);
+    if (code && !emu->static_active) {
+        emu->static_code = NULL;
+        return 1;
+    }
+    return 0;
+}
+
+// writes to compiled instructions hand the ROM to the interpreter
+static inline void invalidate_static_code(OctEmu *emu, const uint16_t addr, const uint16_t len) {
+    if (!emu->static_active)
+        return;
+    for (uint16_t a = addr > 0x200 ? addr : 0x200; a < addr + len && a < 0x200 + emu->rom_size; a++) {
+        if (emu->static_code->code_mask[(a - 0x200) / 8] >> (a - 0x200) % 8 & 1) {
+            emu->static_active = false;
+            return;
+        }
+    }
+}
+#endif
+
+int octemu_init(OctEmu *emu, OctEmuMode mode) {
+    if (!get_run_func(mode)) {
+        fprintf(stderr, "Unsupported mode %d\n", mode);
+        return 1;
+    }
+    memset(emu, 0, sizeof(OctEmu));
+#ifdef OCTEMU_PAGED_MEM
+    map_image(emu);
+#else
+    memcpy(emu->mem, &fonts, sizeof(fonts));
+#endif
+    emu->mode = mode;
+    emu->pc = 0x200;
+    emu->rng = seed_state(0);
+    emu->idle_skip = true;
+    return 0;
+}
 
 OctEmu *octemu_new(OctEmuMode mode) {
-    OctEmu *emu = calloc(1, sizeof(OctEmu));
-    if (!emu)
+    OctEmu *emu = malloc(sizeof(OctEmu));
+    if (!emu) {
         fputs("Failed to create OctEmu\n", stderr);
-    else {
-        memcpy(emu->mem, sprites, sizeof(sprites));
-        memcpy(emu->mem + sizeof(sprites), sprites_hr, sizeof(sprites_hr));
-        emu->mode = mode;
-        emu->pc = 0x200;
+        return NULL;
+    }
+    if (octemu_init(emu, mode)) {
+        free(emu);
+        return NULL;
     }
+    octemu_set_predecode(emu, true);
     return emu;
 }
 
+int octemu_set_mode(OctEmu *emu, const OctEmuMode mode) {
+    if (!get_run_func(mode))
+        return 1;
+#ifdef OCTEMU_JIT
+    if (mode != emu->mode)
+        jit_flush(emu); // blocks are compiled for one mode
+#endif
+    emu->mode = mode;
+#ifdef OCTEMU_AOT
+    check_static_code(emu);
+#endif
+    return 0;
+}
+
+int octemu_set_predecode(OctEmu *emu, const bool enable) {
+    if (!enable) {
+        free(emu->decoded);
+        emu->decoded = NULL;
+    } else if (!emu->decoded) {
+        emu->decoded = calloc(OCTEMU_DECODED_SIZE, sizeof(OctEmuInsn));
+        if (!emu->decoded)
+            return 1;
+        for (int n = OCTEMU_DECODED_PCS; n < OCTEMU_DECODED_SIZE; n++)
+            emu->decoded[n].op = OP_BAD_PC;
+    }
+    return 0;
+}
+
+static inline void clear_decoded(OctEmu *emu) {
+#ifdef OCTEMU_JIT
+    jit_flush(emu);
+#endif
+    if (emu->decoded)
+        memset(emu->decoded, 0, OCTEMU_DECODED_PCS * sizeof(OctEmuInsn));
+}
+
+// memory after reset: fonts and ROM, the rest zeroed
+static void load_image(const OctEmu *emu, uint8_t *mem) {
+    memcpy(mem, &fonts, sizeof(fonts));
+    memset(mem + sizeof(fonts), 0, 0x200 - sizeof(fonts));
+    if (emu->rom)
+        memcpy(mem + 0x200, emu->rom, emu->rom_size);
+    memset(mem + 0x200 + emu->rom_size, 0, OCTEMU_MEM_SIZE - 0x200 - emu->rom_size);
+}
+
+void octemu_set_seed(OctEmu *emu, const uint32_t seed) {
+    emu->seed = seed;
+    emu->rng = seed_state(seed);
+}
+
+uint32_t octemu_get_seed(const OctEmu *emu) { return emu->seed; }
+
+void octemu_set_idle_skip(OctEmu *emu, const bool enable) { emu->idle_skip = enable; }
+
 void octemu_reset(OctEmu *emu) {
     emu->i = emu->sp = emu->delay = emu->sound = emu->keypad = 0;
-    emu->gfx_dirty = emu->hires = false;
+    emu->hires = false;
+    emu->gfx_dirty = 0;
+    emu->rng = seed_state(emu->seed);
     emu->pc = 0x200;
     memset(emu->v, 0, sizeof(emu->v));
     memset(emu->stack, 0, sizeof(emu->stack));
 
-    memcpy(emu->mem, sprites, sizeof(sprites));
-    memcpy(emu->mem + sizeof(sprites), sprites_hr, sizeof(sprites_hr));
-    memset(emu->mem + sizeof(sprites) + sizeof(sprites_hr),
-           0, 0x200 - sizeof(sprites) - sizeof(sprites_hr));
-    if (emu->rom) {
-        memcpy(emu->mem + 0x200, emu->rom, emu->rom_size);
-        memset(emu->mem + 0x200 + emu->rom_size, 0, OCTEMU_MEM_SIZE - 0x200 - emu->rom_size);
-    } else {
-        memset(emu->mem + 0x200, 0, OCTEMU_MEM_SIZE - 0x200);
+#ifdef OCTEMU_PAGED_MEM
+    map_image(emu);
+#else
+    load_image(emu, emu->mem);
+#endif
+    if (!emu->rom)
         memset(emu->rpl, 0, sizeof(emu->rpl));
+    memset(&emu->gfx, 0, sizeof(emu->gfx));
+    clear_decoded(emu);
+#ifdef OCTEMU_AOT
+    check_static_code(emu);
+#endif
+}
+
+// replace all of memory, pages equal to the memory after reset stay shared
+static int set_mem(OctEmu *emu, const uint8_t *mem) {
+#ifdef OCTEMU_PAGED_MEM
+    map_image(emu);
+    for (uint16_t addr = 0; addr < OCTEMU_MEM_SIZE; addr += OCTEMU_PAGE_SIZE) {
+        if (memcmp(emu->pages[addr / OCTEMU_PAGE_SIZE], mem + addr, OCTEMU_PAGE_SIZE) &&
+            mem_write(emu, addr, mem + addr, OCTEMU_PAGE_SIZE))
+            return 1;
     }
-    memset(emu->gfx, 0, sizeof(emu->gfx));
+#else
+    memcpy(emu->mem, mem, OCTEMU_MEM_SIZE);
+#endif
+    return 0;
 }
 
-void octemu_free(OctEmu *emu) {
+// free the ROM, the predecode cache and compiled blocks if owned
+static void release(OctEmu *emu) {
     if (emu->rom && !emu->rom_external)
         free(emu->rom);
+#ifdef OCTEMU_JIT
+    octemu_set_jit(emu, false);
+#endif
+    free(emu->decoded);
+    emu->rom = NULL;
+    emu->decoded = NULL;
+}
+
+void octemu_deinit(OctEmu *emu) {
+    release(emu);
+#ifdef OCTEMU_PAGED_MEM
+    free_private_pages(emu);
+#endif
+}
+
+void octemu_free(OctEmu *emu) {
+    octemu_deinit(emu);
     free(emu);
 }
 
+int octemu_clone(OctEmu *dst, const OctEmu *src) {
+    if (dst == src)
+        return 0;
+#ifdef OCTEMU_PAGED_MEM
+    // allocate pages for the written ones first, so dst is untouched on failure
+    for (int p = 0; p < OCTEMU_MEM_PAGES; p++) {
+        if (src->pages[p] == src->private_pages[p] && !dst->private_pages[p] &&
+            !(dst->private_pages[p] = malloc(OCTEMU_PAGE_SIZE))) {
+            fputs("Failed to allocate memory page\n", stderr);
+            return 1;
+        }
+    }
+    uint8_t *private_pages[OCTEMU_MEM_PAGES];
+    memcpy(private_pages, dst->private_pages, sizeof(private_pages));
+#endif
+    if (dst->rom && !dst->rom_external)
+        free(dst->rom);
+    OctEmuInsn *decoded = dst->decoded;
+#ifdef OCTEMU_JIT
+    OctEmuJit *jit = dst->jit;
+#endif
+    *dst = *src;
+    dst->rom_external = true; // borrowed from src, which keeps owning it
+    dst->decoded = decoded;
+#ifdef OCTEMU_JIT
+    dst->jit = jit;
+    jit_flush(dst);
+#endif
+    if (decoded && src->decoded)
+        memcpy(decoded, src->decoded, OCTEMU_DECODED_SIZE * sizeof(OctEmuInsn));
+    else
+        clear_decoded(dst);
+#ifdef OCTEMU_PAGED_MEM
+    // shared pages stay mapped, only written ones are copied
+    memcpy(dst->private_pages, private_pages, sizeof(private_pages));
+    for (int p = 0; p < OCTEMU_MEM_PAGES; p++) {
+        if (src->pages[p] == src->private_pages[p]) {
+            memcpy(dst->private_pages[p], src->pages[p], OCTEMU_PAGE_SIZE);
+            dst->pages[p] = dst->private_pages[p];
+        }
+    }
+#endif
+    return 0;
+}
+
+struct OctEmuPool {
+    OctEmu *slots;
+    size_t count, free_count;
+    OctEmu **free_slots; // stack of released slots
+};
+
+OctEmuPool *octemu_pool_new(const size_t count) {
+    OctEmuPool *pool = calloc(1, sizeof(OctEmuPool));
+    if (pool) {
+        pool->slots = calloc(count, sizeof(OctEmu));
+        pool->free_slots = malloc(count * sizeof(OctEmu *));
+    }
+    if (!pool || !pool->slots || !pool->free_slots) {
+        fputs("Failed to create OctEmuPool\n", stderr);
+        if (pool) {
+            free(pool->slots);
+            free(pool->free_slots);
+        }
+        free(pool);
+        return NULL;
+    }
+    pool->count = pool->free_count = count;
+    // hand out slots in address order
+    for (size_t n = 0; n < count; n++)
+        pool->free_slots[n] = pool->slots + count - 1 - n;
+    return pool;
+}
+
+void octemu_pool_free(OctEmuPool *pool) {
+#ifdef OCTEMU_PAGED_MEM
+    for (size_t n = 0; n < pool->count; n++)
+        free_private_pages(pool->slots + n);
+#endif
+    free(pool->slots);
+    free(pool->free_slots);
+    free(pool);
+}
+
+OctEmu *octemu_pool_clone(OctEmuPool *pool, const OctEmu *src) {
+    if (!pool->free_count)
+        return NULL;
+    OctEmu *emu = pool->free_slots[pool->free_count - 1];
+    if (octemu_clone(emu, src))
+        return NULL;
+    pool->free_count--;
+    return emu;
+}
+
+void octemu_pool_release(OctEmuPool *pool, OctEmu *emu) {
+    release(emu); // private pages are kept for the next clone in this slot
+    pool->free_slots[pool->free_count++] = emu;
+}
+
+size_t octemu_pool_available(const OctEmuPool *pool) { return pool->free_count; }
+
 void octemu_print_states(const OctEmu *emu) {
     fprintf(stderr, "\nPC: 0x%.4X I: 0x%.4X SP: %d\n", emu->pc, emu->i, emu->sp);
     for (int i = 0; i < 8; i++)
@@ -110,7 +531,8 @@ void octemu_print_states(const OctEmu *emu) {
     fputs("\nStack:", stderr);
     for (uint8_t i = 0; i < emu->sp; i++)
         fprintf(stderr, " 0x%.4X", emu->stack[i]);
-    fprintf(stderr, "\nHires Mode: %d\nGFX_Dirty: %d", emu->hires, emu->gfx_dirty);
+    fprintf(stderr, "\nHires Mode: %d\nGFX_Dirty: 0x%.16llX", emu->hires,
+            (unsigned long long)emu->gfx_dirty);
     fprintf(stderr, "\nDelay Timer: %d\nSound Timer: %d", emu->delay, emu->sound);
     fputs("\nKeypad State:", stderr);
     for (int b = 0; b < 16; b++) {
@@ -120,529 +542,371 @@ void octemu_print_states(const OctEmu *emu) {
     fputs("\n\n", stderr);
 }
 
-// 76543210 -> 77665544 33221100
-static inline void expand_uint8(const uint8_t val, uint8_t *left, uint8_t *right) {
-    for (uint8_t b = 0; b < 4; b++) {
-        if (val >> b & 1)
-            *right |= 3 << b * 2;
-        if (val >> (b + 4) & 1)
-            *left |= 3 << b * 2;
-    }
-}
+// 76543210 -> 7766554433221100
+#define EXPAND_BIT(v, b) ((v) >> (b) & 1 ? 3u << (b) * 2 : 0)
+#define EXPAND(v) (EXPAND_BIT(v, 0) | EXPAND_BIT(v, 1) | EXPAND_BIT(v, 2) | EXPAND_BIT(v, 3) | \
+                   EXPAND_BIT(v, 4) | EXPAND_BIT(v, 5) | EXPAND_BIT(v, 6) | EXPAND_BIT(v, 7))
+#define EXPAND4(v) EXPAND(v), EXPAND(v + 1), EXPAND(v + 2), EXPAND(v + 3)
+#define EXPAND16(v) EXPAND4(v), EXPAND4(v + 4), EXPAND4(v + 8), EXPAND4(v + 12)
+#define EXPAND64(v) EXPAND16(v), EXPAND16(v + 16), EXPAND16(v + 32), EXPAND16(v + 48)
 
-static inline uint8_t wrap_col(const uint8_t col) { return col & (OCTEMU_GFX_WIDTH / 8 - 1); }
-static inline uint8_t wrap_row(const uint8_t row) { return row & (OCTEMU_GFX_HEIGHT - 1); }
+static const uint16_t expand_table[256] = {
+    EXPAND64(0), EXPAND64(64), EXPAND64(128), EXPAND64(192)
+};
 
-static void put_pixels_hr(OctEmu *emu, const uint8_t x_col, const uint8_t y, const uint8_t rows,
-                          const uint8_t cols, const uint8_t pixels[][cols]) {
-    emu->v[0xF] = 0;
-    for (uint8_t r = 0; r < rows; r++) {
-        uint8_t *row = emu->gfx[wrap_row(y + r)];
-        for (uint8_t c = 0; c < cols; c++) {
-            const uint8_t col = wrap_col(x_col + c);
-            emu->v[0xF] |= (pixels[r][c] & row[col]) != 0;
-            row[col] ^= pixels[r][c];
-        }
-    }
+// expand 32 lowres pixels to 64 hires pixels
+static inline uint64_t expand_uint32(const uint32_t val) {
+    return (uint64_t)expand_table[val >> 24] << 48 | (uint64_t)expand_table[val >> 16 & 0xFF] << 32 |
+           (uint64_t)expand_table[val >> 8 & 0xFF] << 16 | expand_table[val & 0xFF];
 }
 
-// lowres mode draws 2 * rows
-static void put_pixels_lr(OctEmu *emu, const uint8_t x_col, const uint8_t y, const uint8_t rows,
-                          const uint8_t cols, const uint8_t pixels[][cols]) {
-    emu->v[0xF] = 0;
-    for (uint8_t r = 0; r < rows; r++) {
-        uint8_t *row1 = emu->gfx[wrap_row(y + r * 2)];
-        uint8_t *row2 = emu->gfx[wrap_row(y + r * 2 + 1)];
-        for (uint8_t c = 0; c < cols; c++) {
-            const uint8_t col = wrap_col(x_col + c);
-            emu->v[0xF] |= (pixels[r][c] & row1[col]) != 0;
-            row1[col] ^= pixels[r][c];
-            row2[col] = row1[col];
-        }
+void octemu_get_row(const OctEmu *emu, const uint8_t y, uint64_t row[2]) {
+    if (emu->hires) {
+        row[0] = emu->gfx.hr[y][0];
+        row[1] = emu->gfx.hr[y][1];
+    } else {
+        const uint64_t lr = emu->gfx.lr[y >> 1];
+        row[0] = expand_uint32(lr >> 32);
+        row[1] = expand_uint32(lr & 0xFFFFFFFF);
     }
 }
 
-/**
- *   x
- * |r| mem[i] | 8-r  |
- * |  col   |  col+1 | <- row
- */
-
-static int draw8hr(OctEmu *emu, const uint8_t vx, const uint8_t vy, const uint8_t n) {
-    const uint8_t x = vx & (OCTEMU_GFX_WIDTH - 1), y = vy & (OCTEMU_GFX_HEIGHT - 1);
-    uint8_t rows, cols = 1;
-    if (octo_mode)
-        rows = n;
-    else { // clip y
-        const uint8_t max_row = OCTEMU_GFX_HEIGHT - y;
-        rows = n > max_row ? max_row : n;
-    }
-    if (emu->i > OCTEMU_MEM_SIZE - rows)
-        return 1;
-    const uint8_t x_col = x >> 3, r = x & 7;
-    if ((octo_mode || x_col < OCTEMU_GFX_WIDTH / 8 - 1) && r != 0)
-        ++cols;
-    uint8_t pixels[rows][cols];
-    for (uint8_t i = 0; i < rows; i++) {
-        pixels[i][0] = emu->mem[emu->i + i] >> r;
-        if (cols < 2) continue;
-        pixels[i][1] = emu->mem[emu->i + i] << (8 - r);
-    }
-    put_pixels_hr(emu, x_col, y, rows, cols, pixels);
-    return 0;
+uint64_t octemu_take_gfx_dirty(OctEmu *emu) {
+    const uint64_t dirty = emu->gfx_dirty;
+    emu->gfx_dirty = 0;
+    return dirty;
 }
 
-/**
- *   x
- * |r|  m[i]  | m[i+1] | 8-r  |
- * |  col   |  col+1 |  col+2 | <- row
- */
-
-static int draw16hr(OctEmu *emu, const uint8_t vx, const uint8_t vy) {
-    const uint8_t x = vx & (OCTEMU_GFX_WIDTH - 1), y = vy & (OCTEMU_GFX_HEIGHT - 1);
-    uint8_t rows, cols;
-    if (octo_mode)
-        rows = 16;
-    else { // clip y
-        const uint8_t max_row = OCTEMU_GFX_HEIGHT - y;
-        rows = 16 > max_row ? max_row : 16;
+uint64_t octemu_gfx_hash(const OctEmu *emu) {
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (uint8_t y = 0; y < OCTEMU_GFX_HEIGHT; y++) {
+        uint64_t row[2];
+        octemu_get_row(emu, y, row);
+        for (int w = 0; w < 2; w++) {
+            for (int b = 56; b >= 0; b -= 8) {
+                hash ^= row[w] >> b & 0xFF;
+                hash *= 0x100000001B3ULL;
+            }
+        }
     }
-    if (emu->i > OCTEMU_MEM_SIZE - rows * 2)
-        return 1;
-    const uint8_t x_col = x >> 3, r = x & 7;
-    if (octo_mode || x_col < OCTEMU_GFX_WIDTH / 8 - 2)
-        cols = 2 + (r != 0);
-    else
-        cols = OCTEMU_GFX_WIDTH / 8 - x_col;
-    uint8_t pixels[rows][cols];
-    for (uint8_t i = 0; i < rows; i++) {
-        const uint8_t left = emu->mem[emu->i + i * 2], right = emu->mem[emu->i + i * 2 + 1];
-        pixels[i][0] = left >> r;
-        if (cols < 2) continue;
-        pixels[i][1] = (left << (8 - r)) | (right >> r);
-        if (cols < 3) continue;
-        pixels[i][2] = right << (8 - r);
-    }
-    put_pixels_hr(emu, x_col, y, rows, cols, pixels);
-    return 0;
+    return hash;
 }
 
-/**
- *   x
- *   | 7 6 5 4 3 2 1 0 | <- mem[i]
- *   |77665544|33221100|
- * |r|  left  | right  | 8-r  |
- * |  col   |  col+1 |  col+2 | <- row1
- * |  col   |  col+1 |  col+2 | <- row2
- */
+// rows y..y+n-1 (wrapping around) of a screen with 64 rows
+static inline uint64_t rows_mask_hr(const uint8_t y, const uint8_t n) {
+    const uint64_t mask = (1ULL << n) - 1; // n <= 16
+    return y ? mask << y | mask >> (64 - y) : mask;
+}
 
-static int draw8lr(OctEmu *emu, const uint8_t vx, const uint8_t vy, const uint8_t n) {
-    const uint8_t x = vx * 2 & (OCTEMU_GFX_WIDTH - 1), y = vy * 2 & (OCTEMU_GFX_HEIGHT - 1);
-    uint8_t rows, cols;
-    if (octo_mode)
-        rows = n;
-    else {
-        const uint8_t max_row = (OCTEMU_GFX_HEIGHT - y) >> 1;
-        rows = n > max_row ? max_row : n;
-    }
-    if (emu->i > OCTEMU_MEM_SIZE - rows)
-        return 1;
-    const uint8_t x_col = x >> 3, r = x & 7;
-    if (octo_mode || x_col < OCTEMU_GFX_WIDTH / 8 - 2)
-        cols = 2 + (r != 0);
-    else
-        cols = OCTEMU_GFX_WIDTH / 8 - x_col;
-    uint8_t pixels[rows][cols];
-    for (uint8_t i = 0; i < rows; i++) {
-        uint8_t left = 0, right = 0;
-        expand_uint8(emu->mem[emu->i + i], &left, &right);
-        pixels[i][0] = left >> r;
-        if (cols < 2) continue;
-        pixels[i][1] = left << (8 - r) | right >> r;
-        if (cols < 3) continue;
-        pixels[i][2] = right << (8 - r);
-    }
-    put_pixels_lr(emu, x_col, y, rows, cols, pixels);
-    return 0;
+// rows y..y+n-1 (wrapping around) of a screen with 32 rows, scaled up to 64 rows
+static inline uint64_t rows_mask_lr(const uint8_t y, const uint8_t n) {
+    const uint32_t mask = (1U << n) - 1;
+    return expand_uint32(y ? mask << y | mask >> (32 - y) : mask);
 }
 
 /**
+ * XOR a row of w (<= 16) pixels (MSB is the leftmost pixel) into a framebuffer row at
+ * column x. Pixels past the right edge wrap around if wrap is set and are clipped otherwise.
+ *
  *   x
- *   |      mem[i]     |     mem[i+1]    |
- *   | 7 6 5 4 3 2 1 0 | 7 6 5 4 3 2 1 0 |
- *   |77665544|33221100|77665544|33221100|
- * |r|  left1 | right1 |  left2 | right2 | 8-r  |
- * |  col   |  col+1 |  col+2 |  col+3 |  col+4 | <- row1
- * |  col   |  col+1 |  col+2 |  col+3 |  col+4 | <- row2
+ * |r| bits       |
+ * |    row[0]    |    row[1]    |
+ * | 127 .. 64    | 63 .. 0      | <- bit
  */
 
-// Why should I write this??? :(
-static int draw16lr(OctEmu *emu, const uint8_t vx, const uint8_t vy) {
-    const uint8_t x = vx * 2 & (OCTEMU_GFX_WIDTH - 1), y = vy * 2 & (OCTEMU_GFX_HEIGHT - 1);
-    uint8_t rows, cols;
-    if (octo_mode)
-        rows = 16;
-    else {
-        const uint8_t max_row = (OCTEMU_GFX_HEIGHT - y) >> 1;
-        rows = 16 > max_row ? max_row : 16;
-    }
-    if (emu->i > OCTEMU_MEM_SIZE - rows * 2)
-        return 1;
-    const uint8_t x_col = x >> 3, r = x & 7;
-    if (octo_mode || x_col < OCTEMU_GFX_WIDTH / 8 - 4)
-        cols = 4 + (r != 0);
-    else
-        cols = OCTEMU_GFX_WIDTH / 8 - x_col;
-    uint8_t pixels[rows][cols]; // precomputed values
-    for (uint8_t i = 0; i < rows; i++) {
-        uint8_t left1 = 0, right1 = 0, left2 = 0, right2 = 0;
-        expand_uint8(emu->mem[emu->i + i * 2], &left1, &right1);
-        expand_uint8(emu->mem[emu->i + i * 2 + 1], &left2, &right2);
-        pixels[i][0] = left1 >> r;
-        if (cols < 2) continue;
-        pixels[i][1] = left1 << (8 - r) | right1 >> r;
-        if (cols < 3) continue;
-        pixels[i][2] = right1 << (8 - r) | left2 >> r;
-        if (cols < 4) continue;
-        pixels[i][3] = left2 << (8 - r) | right2 >> r;
-        if (cols < 5) continue;
-        pixels[i][4] = right2 << (8 - r);
-    }
-    put_pixels_lr(emu, x_col, y, rows, cols, pixels);
-    return 0;
-}
-
-static inline int arithmetic_eval(OctEmu *emu, const uint16_t ins) {
-    // assert(ins >> 12 == 0x8);
-    uint8_t *vx = &emu->v[ins_x], *vy = &emu->v[ins_y], flag;
-    switch (ins & 0xF) {
-    case 0: // mov vx, vy
-        *vx = *vy;
-        return 0;
-    case 0x1: // or vx, vy
-        *vx |= *vy;
-        if (chip8_mode)
-            emu->v[0xF] = 0;
-        break;
-    case 0x2: // and vx, vy
-        *vx &= *vy;
-        if (chip8_mode)
-            emu->v[0xF] = 0;
-        break;
-    case 0x3: // xor vx, vy
-        *vx ^= *vy;
-        if (chip8_mode)
-            emu->v[0xF] = 0;
-        break;
-    case 0x4: // add vx, vy
-        flag = *vx > 0xFF - *vy;
-        *vx += *vy;
-        emu->v[0xF] = flag;
-        break;
-    case 0x5: // sub vx, vy
-        flag = *vx >= *vy;
-        *vx -= *vy;
-        emu->v[0xF] = flag;
-        break;
-    case 0x6:
-        if (schip_mode) { // shr vx
-            flag = *vx & 1;
-            *vx >>= 1;
-        } else { // shr vx, vy
-            flag = *vy & 1;
-            *vx = *vy >> 1;
-        }
-        emu->v[0xF] = flag;
-        break;
-    case 0x7: // subn vx, vy
-        flag = *vy >= *vx;
-        *vx = *vy - *vx;
-        emu->v[0xF] = flag;
-        break;
-    case 0xE:
-        if (schip_mode) { // shl vx
-            flag = *vx >> 7;
-            *vx <<= 1;
-        } else { // shl vx, vy
-            flag = *vy >> 7;
-            *vx = *vy << 1;
-        }
-        emu->v[0xF] = flag;
-        break;
-    default:
-        return 1;
+static inline bool put_row_hr(uint64_t row[2], const uint16_t bits, const uint8_t w,
+                              const uint8_t x, const bool wrap) {
+    const uint64_t top = (uint64_t)bits << (64 - w);
+    uint64_t hi, lo;
+    if (x < 64) {
+        hi = top >> x;
+        lo = x ? top << (64 - x) : 0;
+    } else {
+        hi = wrap && x + w > OCTEMU_GFX_WIDTH ? top << (OCTEMU_GFX_WIDTH - x) : 0;
+        lo = top >> (x - 64);
     }
-    return 0;
+    const bool collision = (row[0] & hi) || (row[1] & lo);
+    row[0] ^= hi;
+    row[1] ^= lo;
+    return collision;
 }
 
-static inline void clear_gfx(OctEmu *emu) { memset(emu->gfx, 0, sizeof(emu->gfx)); }
+// Same as put_row_hr() on a 64 pixels wide lowres row
+static inline bool put_row_lr(uint64_t *row, const uint16_t bits, const uint8_t w,
+                              const uint8_t x, const bool wrap) {
+    const uint64_t top = (uint64_t)bits << (64 - w);
+    uint64_t pixels = top >> x;
+    if (wrap && x + w > OCTEMU_GFX_WIDTH / 2)
+        pixels |= top << (OCTEMU_GFX_WIDTH / 2 - x);
+    const bool collision = (*row & pixels) != 0;
+    *row ^= pixels;
+    return collision;
+}
 
-int octemu_eval(OctEmu *emu, const uint16_t keypad) {
-    if (emu->pc > OCTEMU_MEM_SIZE - 2 || emu->pc < 0x200) {
-        fprintf(stderr, "PC memory access out of bound: 0x%.4X\n", emu->pc);
-        goto err;
-    }
-    const uint16_t ins = emu->mem[emu->pc] << 8 | emu->mem[emu->pc + 1];
-    emu->pc += 2;
+static void decode(const uint16_t ins, OctEmuInsn *d) {
+    d->x = ins_x;
+    d->y = ins_y;
+    d->n = ins_n;
+    d->nn = ins_nn;
+    d->nnn = ins_nnn;
+    d->op = OP_INVALID;
     switch (ins >> 12) {
     case 0:
         if (ins >> 8)
-            goto err_invalid_ins;
-        if (((ins & 0xF0) >> 4) == 0xC && ins_n) {
-            const uint8_t n = emu->hires ? ins_n : ins_n * 2;
-            for (int y = OCTEMU_GFX_HEIGHT - 1; y >= n; y--)
-                memcpy(emu->gfx[y], emu->gfx[y - n], sizeof(emu->gfx[y]));
-            memset(emu->gfx, 0, sizeof(emu->gfx[0]) * n);
-            emu->gfx_dirty = true;
-        } else switch (ins & 0xFF) {
-        case 0x00:
-            return 1;
-        case 0xE0: // cls
-            clear_gfx(emu);
-            emu->gfx_dirty = true;
-            break;
-        case 0xEE: // ret
-            if (!emu->sp) {
-                fputs("Return from empty stack\n", stderr);
-                goto err;
-            }
-            emu->pc = emu->stack[--emu->sp];
-            break;
-        case 0xFB:
-            if (emu->hires) {
-                for (int y = 0; y < OCTEMU_GFX_HEIGHT; y++) {
-                    uint8_t *row = emu->gfx[y];
-                    for (int x = OCTEMU_GFX_WIDTH / 8 - 1; x > 0; x--){
-                        row[x] >>= 4;
-                        row[x] |= row[x - 1] << 4;
-                    }
-                    row[0] >>= 4;
-                }
-            } else {
-                for (int y = 0; y < OCTEMU_GFX_HEIGHT; y++) {
-                    uint8_t *row = emu->gfx[y];
-                    for (int x = OCTEMU_GFX_WIDTH / 8 - 1; x > 0; x--)
-                        row[x] = row[x - 1];
-                    row[0] = 0;
-                }
-            }
-            emu->gfx_dirty = true;
-            break;
-        case 0xFC:
-            if (emu->hires) {
-                for (int y = 0; y < OCTEMU_GFX_HEIGHT; y++) {
-                    uint8_t *row = emu->gfx[y];
-                    for (int x = 0; x < OCTEMU_GFX_WIDTH / 8 - 1; x++) {
-                        row[x] <<= 4;
-                        row[x] |= row[x + 1] >> 4;
-                    }
-                    row[OCTEMU_GFX_WIDTH / 8 - 1] <<= 4;
-                }
-            } else {
-                for (int y = 0; y < OCTEMU_GFX_HEIGHT; y++) {
-                    uint8_t *row = emu->gfx[y];
-                    for (int x = 0; x < OCTEMU_GFX_WIDTH / 8 - 1; x++)
-                        row[x] = row[x + 1];
-                    row[OCTEMU_GFX_WIDTH / 8 - 1] = 0;
-                }
-            }
-            emu->gfx_dirty = true;
-            break;
-        case 0xFD: // exit
-            return 1;
-        case 0xFE:
-            emu->hires = false;
-            clear_gfx(emu);
-            emu->gfx_dirty = true;
             break;
-        case 0xFF:
-            emu->hires = true;
-            clear_gfx(emu);
-            emu->gfx_dirty = true;
+        if (ins_y == 0xC && ins_n) {
+            d->op = OP_SCD;
             break;
-        default:
-            goto err_invalid_ins;
         }
-        break;
-    case 0x1: // jmp nnn
-        emu->pc = ins_nnn;
-        break;
-    case 0x2: // call nnn
-        if (emu->sp >= OCTEMU_STACK_SIZE) {
-            fputs("Stack Overflow\n", stderr);
-            goto err;
+        switch (ins_nn) {
+        case 0x00: case 0xFD: d->op = OP_EXIT; break;
+        case 0xE0: d->op = OP_CLS; break;
+        case 0xEE: d->op = OP_RET; break;
+        case 0xFB: d->op = OP_SCR; break;
+        case 0xFC: d->op = OP_SCL; break;
+        case 0xFE: d->op = OP_LOW; break;
+        case 0xFF: d->op = OP_HIGH; break;
         }
-        emu->stack[emu->sp++] = emu->pc;
-        emu->pc = ins_nnn;
-        break;
-    case 0x3: // se vx, nn
-        if (emu->v[ins_x] == ins_nn)
-            emu->pc += 2;
-        break;
-    case 0x4: // sne vx, nn
-        if (emu->v[ins_x] != ins_nn)
-            emu->pc += 2;
-        break;
-    case 0x5: // se vx, vy
-        if (ins & 0xF)
-            goto err_invalid_ins;
-        if (emu->v[ins_x] == emu->v[ins_y])
-            emu->pc += 2;
-        break;
-    case 0x6: // mov vx, nn
-        emu->v[ins_x] = ins_nn;
-        break;
-    case 0x7: // add vx, nn
-        emu->v[ins_x] += ins_nn;
         break;
+    case 0x1: d->op = OP_JP; break;
+    case 0x2: d->op = OP_CALL; break;
+    case 0x3: d->op = OP_SE_NN; break;
+    case 0x4: d->op = OP_SNE_NN; break;
+    case 0x5: if (!ins_n) d->op = OP_SE_VY; break;
+    case 0x6: d->op = OP_MOV_NN; break;
+    case 0x7: d->op = OP_ADD_NN; break;
     case 0x8:
-        if (arithmetic_eval(emu, ins))
-            goto err_invalid_ins;
+        switch (ins_n) {
+        case 0x0: d->op = OP_MOV; break;
+        case 0x1: d->op = OP_OR; break;
+        case 0x2: d->op = OP_AND; break;
+        case 0x3: d->op = OP_XOR; break;
+        case 0x4: d->op = OP_ADD; break;
+        case 0x5: d->op = OP_SUB; break;
+        case 0x6: d->op = OP_SHR; break;
+        case 0x7: d->op = OP_SUBN; break;
+        case 0xE: d->op = OP_SHL; break;
+        }
         break;
-    case 0x9: // sne vx, vy
-        if (ins & 0xF)
-            goto err_invalid_ins;
-        if (emu->v[ins_x] != emu->v[ins_y])
-            emu->pc += 2;
+    case 0x9: if (!ins_n) d->op = OP_SNE_VY; break;
+    case 0xA: d->op = OP_MOV_I; break;
+    case 0xB: d->op = OP_JP_V0; break;
+    case 0xC: d->op = OP_RND; break;
+    case 0xD: d->op = OP_DRW; break;
+    case 0xE:
+        if (ins_nn == 0x9E)
+            d->op = OP_SKP;
+        else if (ins_nn == 0xA1)
+            d->op = OP_SKNP;
         break;
-    case 0xA: // mov I, nnn
-        emu->i = ins_nnn;
+    case 0xF:
+        switch (ins_nn) {
+        case 0x07: d->op = OP_MOV_DT_TO; break;
+        case 0x0A: d->op = OP_MOV_KEY; break;
+        case 0x15: d->op = OP_MOV_DT; break;
+        case 0x18: d->op = OP_MOV_ST; break;
+        case 0x1E: d->op = OP_ADD_I; break;
+        case 0x29: d->op = OP_SPRITE; break;
+        case 0x30: d->op = OP_SPRITE_HR; break;
+        case 0x33: d->op = OP_BCD; break;
+        case 0x55: d->op = OP_STORE; break;
+        case 0x65: d->op = OP_LOAD; break;
+        case 0x75: d->op = OP_STORE_RPL; break;
+        case 0x85: d->op = OP_LOAD_RPL; break;
+#ifdef OCTEMU_HCF
+        case 0xCF: d->op = OP_HCF; break;
+#endif // OCTEMU_HCF
+        }
         break;
-    case 0xB:
-        if (schip_mode)
-            emu->pc = ins_nnn + emu->v[ins_x]; // jmp vx+xnn
-        else
-            emu->pc = ins_nnn + emu->v[0]; // jmp v0+nnn
+    }
+}
+
+/*
+ * Fuse the instruction decoded at pc with the ones after it, for common idioms:
+ *   add vx, nn; se/sne vy, mm    (loop counters, the skip may test any register)
+ *   mov vx, nn; mov vy, mm       (runs of 6xNN, fused pairwise)
+ *   mov I, nnn; drw vx, vy, n
+ *   mov vx, delay; se vx, 0; jmp back to the mov  (delay wait loops)
+ * The second operands go to fields the first instruction does not use, and base keeps
+ * its op, so run() can still execute it alone when the budget ends inside the sequence.
+ */
+static void fuse(const OctEmu *emu, const uint16_t pc, OctEmuInsn *d) {
+    d->base = d->op;
+    if (pc > OCTEMU_MEM_SIZE - 4)
+        return;
+    OctEmuInsn next;
+    decode(mem_get(emu, pc + 2) << 8 | mem_get(emu, pc + 3), &next);
+    switch (d->op) {
+    case OP_ADD_NN:
+        if (next.op == OP_SE_NN || next.op == OP_SNE_NN) {
+            d->op = next.op == OP_SE_NN ? OP_ADD_SE : OP_ADD_SNE;
+            d->y = next.x;
+            d->n = next.nn;
+        }
         break;
-    case 0xC: // rnd vx, nn
-        emu->v[ins_x] = ins_nn & rand();
+    case OP_MOV_NN:
+        if (next.op == OP_MOV_NN) {
+            d->op = OP_MOV_MOV;
+            d->y = next.x;
+            d->n = next.nn;
+        }
         break;
-    case 0xD: { // mov gfx(vx, vy..), [I]..[I+n-1]
-        const uint8_t vx = emu->v[ins_x], vy = emu->v[ins_y], n = ins_n;
-        if (!n) {
-            if (emu->hires) {
-                if (draw16hr(emu, vx, vy))
-                    goto err_i_memory;
-            } else {
-                if (draw16lr(emu, vx, vy))
-                    goto err_i_memory;
-            }
-        } else {
-            if (emu->hires) {
-                if (draw8hr(emu, vx, vy, n))
-                    goto err_i_memory;
-            } else {
-                if (draw8lr(emu, vx, vy, n))
-                    goto err_i_memory;
-            }
+    case OP_MOV_I:
+        if (next.op == OP_DRW) {
+            d->op = OP_MOV_I_DRW;
+            d->x = next.x;
+            d->y = next.y;
+            d->n = next.n;
         }
-        emu->gfx_dirty = true;
         break;
-    }
-    case 0xE:
-        switch (ins & 0xFF) {
-        case 0x9E: // se vx, key
-            if (keypad & 1 << (emu->v[ins_x] & 0xF))
-                emu->pc += 2;
-            break;
-        case 0xA1: // sne vx, key
-            if (!(keypad & 1 << (emu->v[ins_x] & 0xF)))
-                emu->pc += 2;
-            break;
-        default:
-            goto err_invalid_ins;
+    case OP_MOV_DT_TO:
+        if (pc <= OCTEMU_MEM_SIZE - 6 && next.op == OP_SE_NN && next.x == d->x && !next.nn) {
+            OctEmuInsn jmp;
+            decode(mem_get(emu, pc + 4) << 8 | mem_get(emu, pc + 5), &jmp);
+            if (jmp.op == OP_JP && jmp.nnn == pc)
+                d->op = OP_WAIT_DT;
         }
         break;
-    case 0xF:
-        switch (ins & 0xFF) {
-        case 0x07: // mov vx, delay
-            emu->v[ins_x] = emu->delay;
-            break;
-        case 0x0A: // mov vx, key
-            if (emu->keypad & ~keypad) { // detect released
-                for (int i = 0; i < 16; i++) {
-                    if (emu->keypad & ~keypad & 1 << i) {
-                        emu->v[ins_x] = i;
-                        break;
-                    }
-                }
-            } else
-                emu->pc -= 2;
-            break;
-        case 0x15: // mov delay, vx
-            emu->delay = emu->v[ins_x];
-            break;
-        case 0x18: // mov sound, vx
-            emu->sound = emu->v[ins_x];
-            break;
-        case 0x1E: // mov I, I+vx
-            emu->i += emu->v[ins_x];
-            break;
-        case 0x29: // mov I, &sprite(vx)
-            emu->i = 0 + (emu->v[ins_x] & 0xF) * 5;
-            break;
-        case 0x30: // mov I, &sprites_hr(vx)
-            emu->i = sizeof(sprites) + (emu->v[ins_x] & 0xF) * 10;
-            break;
-        case 0x33: // mov [I]..[I+2], bcd(vx)
-            if (emu->i > OCTEMU_MEM_SIZE - 3)
-                goto err_i_memory;
-            uint8_t remain = emu->v[ins_x];
-            emu->mem[emu->i] = remain / 100;
-            remain -= emu->mem[emu->i] * 100;
-            emu->mem[emu->i + 1] = remain / 10;
-            remain -= emu->mem[emu->i + 1] * 10;
-            emu->mem[emu->i + 2] = remain;
-            break;
-        case 0x55: // mov [I], v0..vx
-            if (emu->i >= OCTEMU_MEM_SIZE - ins_x)
-                goto err_i_memory;
-            memcpy(emu->mem + emu->i, emu->v, (ins_x + 1) * sizeof(uint8_t));
-            if (!schip_mode)
-                emu->i += ins_x + 1;
-            break;
-        case 0x65: // mov v0..vx, [I]
-            if (emu->i >= OCTEMU_MEM_SIZE - ins_x)
-                goto err_i_memory;
-            memcpy(emu->v, emu->mem + emu->i, (ins_x + 1) * sizeof(uint8_t));
-            if (!schip_mode)
-                emu->i += ins_x + 1;
-            break;
-        case 0x75: // mov rpl, v0..vx
-            memcpy(emu->rpl, emu->v, (ins_x + 1) * sizeof(uint8_t));
-            break;
-        case 0x85: // mov v0..vx, rpl
-            memcpy(emu->v, emu->rpl, (ins_x + 1) * sizeof(uint8_t));
-            break;
+    }
+}
 
-#ifdef OCTEMU_HCF
-        case 0xCF: // hcf
-            emu->pc -= 2;
-            emu->sound = 0xFF;
-            break;
-#endif // OCTEMU_HCF
+// Drop cached decodes that overlap mem[addr]..mem[addr+len-1]
+static inline void invalidate_decoded(OctEmu *emu, const uint16_t addr, const uint16_t len) {
+#ifdef OCTEMU_JIT
+    jit_invalidate(emu, addr, len);
+#endif
+#ifdef OCTEMU_AOT
+    invalidate_static_code(emu, addr, len);
+#endif
+    if (!emu->decoded || addr + len <= 0x200)
+        return;
+    // instructions starting up to 5 bytes before addr may be fused with the one reading mem[addr]
+    const uint16_t start = addr > 0x200 + 5 ? addr - 5 : 0x200;
+    for (uint16_t a = start; a < addr + len && a < OCTEMU_MEM_SIZE - 1; a++)
+        emu->decoded[a - 0x200].op = OP_NONE;
+}
 
-        default:
-            goto err_invalid_ins;
-        }
-        break;
+void octemu_invalidate(OctEmu *emu, const uint16_t addr, const uint16_t len) {
+    invalidate_decoded(emu, addr, len);
+}
+
+void octemu_read_mem(const OctEmu *emu, const uint16_t addr, uint8_t *buf, const uint16_t len) {
+    mem_read(emu, addr, buf, len);
+}
+
+int octemu_write_mem(OctEmu *emu, const uint16_t addr, const uint8_t *buf, const uint16_t len) {
+    if (mem_write(emu, addr, buf, len))
+        return 1;
+    invalidate_decoded(emu, addr, len);
+    return 0;
+}
+
+static inline void clear_gfx(OctEmu *emu) { memset(&emu->gfx, 0, sizeof(emu->gfx)); }
+
+// PC after a jump: invalid targets are parked at OCTEMU_PC_FAULT and kept in fault_pc
+static inline uint16_t check_pc(const uint16_t pc, uint16_t *fault_pc) {
+    if (pc < 0x200 || pc > OCTEMU_MEM_SIZE - 2) {
+        *fault_pc = pc;
+        return OCTEMU_PC_FAULT;
     }
-    emu->keypad = keypad;
+    return pc;
+}
+
+// Idle loops: the machine state is kept at a backward jump and compared at the next one to
+// the same target. Timers and keypad do not change during a run, so a loop that comes back to
+// the same state without drawing or writing memory (effects) repeats until the end of the run.
+// A loop that does not is marked busy and not probed again in the run.
+#define IDLE_PROBES 8 // snapshots per run
+
+typedef struct IdleProbe {
+    unsigned int cycles, effects;
+    uint16_t pc, busy, i, stack[OCTEMU_STACK_SIZE];
+    uint8_t v[0x10], rpl[0x10], sp, delay, sound, left;
+    uint32_t rng;
+} IdleProbe;
+
+#define IDLE_PROBE_INIT {.pc = OCTEMU_PC_FAULT, .busy = OCTEMU_PC_FAULT, .left = IDLE_PROBES}
+
+// instructions of the loop back to pc if it is idle, else 0
+static inline unsigned int idle_period(IdleProbe *p, const OctEmu *emu, const uint16_t pc, const uint16_t i,
+                                       const unsigned int cycles, const unsigned int effects) {
+    if (p->pc == pc) {
+        if (p->effects == effects && p->i == i && !memcmp(p->v, emu->v, sizeof(p->v)) && p->sp == emu->sp &&
+            p->delay == emu->delay && p->sound == emu->sound && p->rng == emu->rng &&
+            !memcmp(p->rpl, emu->rpl, sizeof(p->rpl)) && !memcmp(p->stack, emu->stack, emu->sp * sizeof(uint16_t)))
+            return cycles - p->cycles;
+        p->busy = pc;
+        p->pc = OCTEMU_PC_FAULT;
+        return 0;
+    }
+    if (pc == p->busy || !p->left)
+        return 0;
+    p->left--;
+    p->cycles = cycles;
+    p->effects = effects;
+    p->pc = pc;
+    p->i = i;
+    memcpy(p->stack, emu->stack, emu->sp * sizeof(uint16_t));
+    memcpy(p->v, emu->v, sizeof(p->v));
+    memcpy(p->rpl, emu->rpl, sizeof(p->rpl));
+    p->sp = emu->sp;
+    p->delay = emu->delay;
+    p->sound = emu->sound;
+    p->rng = emu->rng;
     return 0;
+}
 
-err_invalid_ins:
-    fprintf(stderr, "Invalid instruction %.4X at 0x%.4X\n", ins, emu->pc - 2);
-    goto err;
+#ifdef OCTEMU_JIT
+#include "core_jit.h"
+#endif
 
-err_i_memory:
-    fprintf(stderr, "I memory access out of bound: 0x%.4X\n", emu->i);
-    goto err;
+// One interpreter per quirk mode, see core_run.h
 
-err:
-#ifdef OCTEMU_DEBUG
-    octemu_print_states(emu);
+#ifndef OCTEMU_NO_MODE_CHIP8
+#define OCTEMU_TMPL_MODE OCTEMU_MODE_CHIP8
+#define OCTEMU_TMPL(name) name##_chip8
+#include "core_run.h"
 #endif
-    return 1;
+
+#ifndef OCTEMU_NO_MODE_SCHIP
+#define OCTEMU_TMPL_MODE OCTEMU_MODE_SCHIP
+#define OCTEMU_TMPL(name) name##_schip
+#include "core_run.h"
+#endif
+
+#ifndef OCTEMU_NO_MODE_OCTO
+#define OCTEMU_TMPL_MODE OCTEMU_MODE_OCTO
+#define OCTEMU_TMPL(name) name##_octo
+#include "core_run.h"
+#endif
+
+static const run_func run_funcs[] = {
+#ifndef OCTEMU_NO_MODE_CHIP8
+    [OCTEMU_MODE_CHIP8] = run_chip8,
+#endif
+#ifndef OCTEMU_NO_MODE_SCHIP
+    [OCTEMU_MODE_SCHIP] = run_schip,
+#endif
+#ifndef OCTEMU_NO_MODE_OCTO
+    [OCTEMU_MODE_OCTO] = run_octo,
+#endif
+};
+
+static inline run_func get_run_func(const OctEmuMode mode) {
+    return (unsigned int)mode < sizeof(run_funcs) / sizeof(run_funcs[0]) ? run_funcs[mode] : NULL;
+}
+
+OctEmuRunResult octemu_run(OctEmu *emu, const unsigned int max_cycles, const uint16_t keypad) {
+    const run_func f = get_run_func(emu->mode);
+    if (!f) {
+        fprintf(stderr, "Unsupported mode %d\n", emu->mode);
+        return (OctEmuRunResult){OCTEMU_STOP_ERROR, 0};
+    }
+    return f(emu, max_cycles, keypad);
+}
+
+int octemu_eval(OctEmu *emu, const uint16_t keypad) {
+    return octemu_run(emu, 1, keypad).stop >= OCTEMU_STOP_EXIT;
 }
 
 void octemu_tick(OctEmu *emu) {
@@ -652,6 +916,34 @@ void octemu_tick(OctEmu *emu) {
         --emu->sound;
 }
 
+// buffer for an owned ROM, zero-padded to a page boundary with OCTEMU_PAGED_MEM so every page maps
+static uint8_t *alloc_rom(OctEmu *emu, const size_t size) {
+#ifdef OCTEMU_PAGED_MEM
+    emu->rom_padded = true;
+    return calloc((size + OCTEMU_PAGE_SIZE - 1) / OCTEMU_PAGE_SIZE, OCTEMU_PAGE_SIZE);
+#else
+    return malloc(size);
+#endif
+}
+
+// copy a newly set ROM into memory (or map its pages)
+static int install_rom(OctEmu *emu) {
+#ifdef OCTEMU_PAGED_MEM
+    if (alloc_rom_tail(emu))
+        return 1;
+    const uint8_t end = (0x200 + emu->rom_size + OCTEMU_PAGE_SIZE - 1) / OCTEMU_PAGE_SIZE;
+    for (uint8_t p = 0x200 / OCTEMU_PAGE_SIZE; p < end; p++)
+        map_rom_page(emu, p);
+#else
+    memcpy(emu->mem + 0x200, emu->rom, emu->rom_size);
+#endif
+    clear_decoded(emu);
+#ifdef OCTEMU_AOT
+    check_static_code(emu);
+#endif
+    return 0;
+}
+
 int octemu_load_rom_file(OctEmu *emu, const char *rom_path) {
     if (emu->rom) {
         fputs("ROM already loaded\n", stderr);
@@ -670,7 +962,7 @@ int octemu_load_rom_file(OctEmu *emu, const char *rom_path) {
         return 1;
     }
     rewind(f);
-    emu->rom = malloc(size);
+    emu->rom = alloc_rom(emu, size);
     if (!emu->rom) {
         fclose(f);
         return 1;
@@ -683,7 +975,7 @@ int octemu_load_rom_file(OctEmu *emu, const char *rom_path) {
     }
     emu->rom_size = size;
     emu->rom_external = false;
-    memcpy(emu->mem + 0x200, emu->rom, emu->rom_size);
+    install_rom(emu); // cannot fail for padded ROMs
     fclose(f);
     return 0;
 }
@@ -697,13 +989,13 @@ int octemu_load_rom(OctEmu *emu, const uint8_t *rom_data, const size_t size) {
         fputs("Invalid ROM size\n", stderr);
         return 1;
     }
-    emu->rom = malloc(size);
+    emu->rom = alloc_rom(emu, size);
     if (!emu->rom)
         return 1;
     memcpy(emu->rom, rom_data, size);
     emu->rom_size = size;
     emu->rom_external = false;
-    memcpy(emu->mem + 0x200, emu->rom, emu->rom_size);
+    install_rom(emu); // cannot fail for padded ROMs
     return 0;
 }
 
@@ -719,7 +1011,14 @@ int octemu_set_rom(OctEmu *emu, const uint8_t *rom_data, const size_t size) {
     emu->rom = (uint8_t *)rom_data;
     emu->rom_size = size;
     emu->rom_external = true;
-    memcpy(emu->mem + 0x200, emu->rom, emu->rom_size);
+#ifdef OCTEMU_PAGED_MEM
+    emu->rom_padded = false;
+#endif
+    if (install_rom(emu)) {
+        emu->rom = NULL;
+        emu->rom_size = 0;
+        return 1;
+    }
     return 0;
 }
 
@@ -732,3 +1031,206 @@ void octemu_clear_rom(OctEmu *emu) {
     }
     octemu_reset(emu);
 }
+
+uint64_t octemu_rom_hash(const OctEmu *emu) {
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (uint16_t n = 0; n < emu->rom_size; n++) {
+        hash ^= emu->rom[n];
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+/*
+ * Save state layout, integers little endian:
+ *   "OCTS", version, mode, hires, sp, ROM hash (u64)
+ *   pc, i (u16), v0-vF, delay, sound, keypad (u16), gfx_dirty (u64), seed, rng (u32)
+ *   stack[0..sp-1] (u16), rpl
+ *   memory changed since reset as runs of {address, length (u16), bytes}, ended by address 0xFFFF
+ *   mask of non-blank screen rows (u64), then those rows (8 bytes lowres, 16 bytes hires)
+ */
+#define STATE_VERSION 1
+#define STATE_GAP 4 // unchanged bytes kept inside a memory run, cheaper than a new run header
+
+typedef struct StateBuf {
+    uint8_t *out;
+    const uint8_t *in;
+    size_t pos, size;
+} StateBuf;
+
+static inline void state_put(StateBuf *s, const uint64_t val, const int bytes) {
+    for (int b = 0; b < bytes; b++, s->pos++) {
+        if (s->out && s->pos < s->size)
+            s->out[s->pos] = val >> b * 8;
+    }
+}
+
+static inline void state_put_bytes(StateBuf *s, const uint8_t *src, const size_t n) {
+    if (s->out && s->pos + n <= s->size)
+        memcpy(s->out + s->pos, src, n);
+    s->pos += n;
+}
+
+// reads past the end give zeros, callers check pos against size
+static inline uint64_t state_get(StateBuf *s, const int bytes) {
+    uint64_t val = 0;
+    for (int b = 0; b < bytes; b++, s->pos++) {
+        if (s->pos < s->size)
+            val |= (uint64_t)s->in[s->pos] << b * 8;
+    }
+    return val;
+}
+
+static inline void state_get_bytes(StateBuf *s, uint8_t *dst, const size_t n) {
+    if (s->pos + n <= s->size)
+        memcpy(dst, s->in + s->pos, n);
+    s->pos += n;
+}
+
+size_t octemu_save_state(const OctEmu *emu, uint8_t *buf, const size_t size) {
+    StateBuf s = {buf, NULL, 0, size};
+    state_put_bytes(&s, (const uint8_t *)"OCTS", 4);
+    state_put(&s, STATE_VERSION, 1);
+    state_put(&s, emu->mode, 1);
+    state_put(&s, emu->hires, 1);
+    state_put(&s, emu->sp, 1);
+    state_put(&s, octemu_rom_hash(emu), 8);
+    state_put(&s, emu->pc, 2);
+    state_put(&s, emu->i, 2);
+    state_put_bytes(&s, emu->v, sizeof(emu->v));
+    state_put(&s, emu->delay, 1);
+    state_put(&s, emu->sound, 1);
+    state_put(&s, emu->keypad, 2);
+    state_put(&s, emu->gfx_dirty, 8);
+    state_put(&s, emu->seed, 4);
+    state_put(&s, emu->rng, 4);
+    for (uint8_t n = 0; n < emu->sp; n++)
+        state_put(&s, emu->stack[n], 2);
+    state_put_bytes(&s, emu->rpl, sizeof(emu->rpl));
+
+    uint8_t mem[OCTEMU_MEM_SIZE], image[OCTEMU_MEM_SIZE];
+    mem_read(emu, 0, mem, OCTEMU_MEM_SIZE);
+    load_image(emu, image);
+    for (uint16_t addr = 0; addr < OCTEMU_MEM_SIZE;) {
+        if (!(addr & 7) && !memcmp(mem + addr, image + addr, 8)) { // skip unchanged words
+            addr += 8;
+            continue;
+        }
+        if (mem[addr] == image[addr]) {
+            addr++;
+            continue;
+        }
+        uint16_t end = addr + 1; // past the last changed byte of the run
+        for (uint16_t a = end; a < OCTEMU_MEM_SIZE && a - end <= STATE_GAP; a++) {
+            if (mem[a] != image[a])
+                end = a + 1;
+        }
+        state_put(&s, addr, 2);
+        state_put(&s, end - addr, 2);
+        state_put_bytes(&s, mem + addr, end - addr);
+        addr = end;
+    }
+    state_put(&s, 0xFFFF, 2);
+
+    const uint8_t rows = emu->hires ? OCTEMU_GFX_HEIGHT : OCTEMU_GFX_HEIGHT / 2;
+    uint64_t mask = 0;
+    for (uint8_t y = 0; y < rows; y++) {
+        if (emu->hires ? emu->gfx.hr[y][0] | emu->gfx.hr[y][1] : emu->gfx.lr[y])
+            mask |= 1ULL << y;
+    }
+    state_put(&s, mask, 8);
+    for (uint8_t y = 0; y < rows; y++) {
+        if (!(mask >> y & 1))
+            continue;
+        if (emu->hires) {
+            state_put(&s, emu->gfx.hr[y][0], 8);
+            state_put(&s, emu->gfx.hr[y][1], 8);
+        } else
+            state_put(&s, emu->gfx.lr[y], 8);
+    }
+
+    if (buf && s.pos > size) {
+        fputs("Save state buffer too small\n", stderr);
+        return 0;
+    }
+    return s.pos;
+}
+
+int octemu_load_state(OctEmu *emu, const uint8_t *buf, const size_t size) {
+    StateBuf s = {NULL, buf, 0, size};
+    uint8_t magic[4] = {0};
+    state_get_bytes(&s, magic, sizeof(magic));
+    if (memcmp(magic, "OCTS", 4) || state_get(&s, 1) != STATE_VERSION) {
+        fputs("Unsupported save state\n", stderr);
+        return 1;
+    }
+    // parse into a copy, so emu stays untouched if the state is invalid
+    OctEmu state = *emu;
+    const uint8_t mode = state_get(&s, 1), hires = state_get(&s, 1);
+    state.sp = state_get(&s, 1);
+    if (state_get(&s, 8) != octemu_rom_hash(emu)) {
+        fputs("Save state is for another ROM\n", stderr);
+        return 1;
+    }
+    if (hires > 1 || state.sp > OCTEMU_STACK_SIZE || octemu_set_mode(&state, mode))
+        goto err;
+    state.hires = hires;
+    state.pc = state_get(&s, 2);
+    state.i = state_get(&s, 2);
+    state_get_bytes(&s, state.v, sizeof(state.v));
+    state.delay = state_get(&s, 1);
+    state.sound = state_get(&s, 1);
+    state.keypad = state_get(&s, 2);
+    state.gfx_dirty = state_get(&s, 8);
+    state.seed = state_get(&s, 4);
+    state.rng = state_get(&s, 4);
+    memset(state.stack, 0, sizeof(state.stack));
+    for (uint8_t n = 0; n < state.sp; n++)
+        state.stack[n] = state_get(&s, 2);
+    state_get_bytes(&s, state.rpl, sizeof(state.rpl));
+
+    uint8_t mem[OCTEMU_MEM_SIZE];
+    load_image(emu, mem);
+    for (uint16_t addr; (addr = state_get(&s, 2)) != 0xFFFF;) {
+        const uint16_t len = state_get(&s, 2);
+        if (s.pos > size || !len || addr + len > OCTEMU_MEM_SIZE)
+            goto err;
+        state_get_bytes(&s, mem + addr, len);
+    }
+
+    const uint8_t rows = hires ? OCTEMU_GFX_HEIGHT : OCTEMU_GFX_HEIGHT / 2;
+    const uint64_t mask = state_get(&s, 8);
+    if (rows < 64 && mask >> rows)
+        goto err;
+    memset(&state.gfx, 0, sizeof(state.gfx));
+    for (uint8_t y = 0; y < rows; y++) {
+        if (!(mask >> y & 1))
+            continue;
+        if (hires) {
+            state.gfx.hr[y][0] = state_get(&s, 8);
+            state.gfx.hr[y][1] = state_get(&s, 8);
+        } else
+            state.gfx.lr[y] = state_get(&s, 8);
+    }
+    if (s.pos != size || !state.rng)
+        goto err;
+
+    *emu = state;
+    clear_decoded(emu);
+    if (set_mem(emu, mem)) {
+        octemu_reset(emu);
+        return 1;
+    }
+#ifdef OCTEMU_AOT
+    check_static_code(emu);
+#endif
+    return 0;
+
+err:
+    fputs("Invalid save state\n", stderr);
+    return 1;
+}
+
+#ifndef OCTEMU_NO_LANES
+#include "core_lanes.h"
+#endif
@@ -2,21 +2,52 @@
 #define _OCTEMU_CORE_H_
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #define OCTEMU_STACK_SIZE 16
 #define OCTEMU_MEM_SIZE 4096
+#define OCTEMU_PAGE_SIZE 256
+#define OCTEMU_MEM_PAGES (OCTEMU_MEM_SIZE / OCTEMU_PAGE_SIZE)
 #define OCTEMU_GFX_WIDTH 128
 #define OCTEMU_GFX_HEIGHT 64
+#define OCTEMU_GFX_DIRTY_ALL UINT64_MAX
+#define OCTEMU_STATE_MAX_SIZE 5238 // largest octemu_save_state() blob
 
 extern const uint8_t OctEmu_Keypad[16];
 
+// Predecoded instruction (opaque)
+typedef struct OctEmuInsn OctEmuInsn;
+
+#ifdef OCTEMU_JIT
+// Compiled basic blocks (opaque)
+typedef struct OctEmuJit OctEmuJit;
+#endif
+
+#ifdef OCTEMU_AOT
+typedef struct OctEmuStaticCode OctEmuStaticCode;
+#endif
+
 typedef enum OctEmuMode {
     OCTEMU_MODE_CHIP8,
     OCTEMU_MODE_SCHIP,
     OCTEMU_MODE_OCTO
 } OctEmuMode;
 
+typedef enum OctEmuStop {
+    OCTEMU_STOP_BUDGET,  // executed max_cycles instructions
+    OCTEMU_STOP_DISPLAY, // display wait (CHIP-8 mode, after drawing)
+    OCTEMU_STOP_KEY,     // waiting for key release (Fx0A)
+    OCTEMU_STOP_IDLE,    // executed max_cycles instructions, the last ones in an idle loop
+    OCTEMU_STOP_EXIT,    // exit instruction (00FD)
+    OCTEMU_STOP_ERROR    // any error occurs
+} OctEmuStop;
+
+typedef struct OctEmuRunResult {
+    OctEmuStop stop;
+    unsigned int cycles; // instructions executed, including the one that stopped the run
+} OctEmuRunResult;
+
 typedef struct OctEmu {
     // mode
     OctEmuMode mode;
@@ -26,22 +57,188 @@ typedef struct OctEmu {
     // timers
     uint8_t delay, sound;
     // states
-    bool hires, gfx_dirty;
+    bool hires;
     uint16_t keypad;
+    uint64_t gfx_dirty; // bit y is set if screen row y changed since last cleared
+    // Cxnn random numbers (xorshift32), restarted from seed by octemu_reset()
+    uint32_t seed, rng;
+    // finish the budget at once in loops that only wait for timers or keypad (octemu_set_idle_skip())
+    bool idle_skip;
     // memory
     uint16_t stack[OCTEMU_STACK_SIZE];
+#ifdef OCTEMU_PAGED_MEM
+    // pages map the fonts and the ROM read-only until written, then a private copy.
+    // Use octemu_read_mem() and octemu_write_mem().
+    const uint8_t *pages[OCTEMU_MEM_PAGES];
+    uint8_t *private_pages[OCTEMU_MEM_PAGES]; // allocated on first write, kept until octemu_deinit()
+#else
     uint8_t mem[OCTEMU_MEM_SIZE];
-    uint8_t gfx[OCTEMU_GFX_HEIGHT][OCTEMU_GFX_WIDTH / 8];
+#endif
+    // 1 bit per pixel, bit 63 is the leftmost pixel. Use octemu_get_row() to read.
+    union {
+        uint64_t hr[OCTEMU_GFX_HEIGHT][OCTEMU_GFX_WIDTH / 64]; // hires 128x64
+        uint64_t lr[OCTEMU_GFX_HEIGHT / 2];                    // lowres 64x32
+    } gfx;
     uint8_t rpl[0x10];
     // ROM
     bool rom_external;
+#ifdef OCTEMU_PAGED_MEM
+    bool rom_padded; // zero-filled up to a page boundary, so the last page maps too
+#endif
     uint16_t rom_size;
     uint8_t *rom;
+    // predecoded instructions for 0x200-0xFFF (NULL if disabled)
+    OctEmuInsn *decoded;
+#ifdef OCTEMU_JIT
+    OctEmuJit *jit; // NULL if disabled
+#endif
+#ifdef OCTEMU_AOT
+    // statically recompiled ROM (NULL if none), used while it matches the ROM, mode and memory
+    const OctEmuStaticCode *static_code;
+    bool static_active;
+#endif
+#ifdef OCTEMU_PROFILE
+    // time spent in Dxyn, counted while enabled
+    struct {
+        bool enabled;
+        uint64_t draws, draw_ticks;
+    } profile;
+#endif
 } OctEmu;
 
 OctEmu *octemu_new(OctEmuMode);
 void octemu_free(OctEmu *);
 
+/**
+ * Set up an emulator in caller-provided storage, as octemu_new() does but
+ * without the predecoded instruction cache (see octemu_set_predecode()).
+ * @return 0 on success, 1 if the mode is not available
+ */
+int octemu_init(OctEmu *, OctEmuMode);
+
+/* Release what an emulator set up by octemu_init() owns, but not the storage itself. */
+void octemu_deinit(OctEmu *);
+
+/**
+ * Fork src into dst, an emulator set up by octemu_new() or octemu_init().
+ * Registers, timers, memory and screen are copied; the ROM is shared, not
+ * copied, so the emulator that loaded it must outlive its clones. If dst has
+ * a predecoded instruction cache it is copied from src (or cleared).
+ * @return 0 on success, 1 if a memory page cannot be allocated (OCTEMU_PAGED_MEM)
+ */
+int octemu_clone(OctEmu *dst, const OctEmu *src);
+
+/**
+ * Emulator pool (opaque): storage for a fixed number of clones in one
+ * allocation, for forking many states (e.g. tree search) without going
+ * through malloc() for each.
+ */
+typedef struct OctEmuPool OctEmuPool;
+
+OctEmuPool *octemu_pool_new(const size_t count);
+
+/* Free the pool and every emulator still taken from it (release those with a predecoded
+   instruction cache first). */
+void octemu_pool_free(OctEmuPool *);
+
+/**
+ * Take an emulator from the pool as an octemu_clone() of src, without a
+ * predecoded instruction cache.
+ * @return NULL if all emulators of the pool are in use
+ */
+OctEmu *octemu_pool_clone(OctEmuPool *, const OctEmu *src);
+
+/* Return an emulator to the pool. Use instead of octemu_free(). */
+void octemu_pool_release(OctEmuPool *, OctEmu *);
+
+/* Emulators left in the pool. */
+size_t octemu_pool_available(const OctEmuPool *);
+
+/**
+ * Switch quirk mode. Modes can be left out of the build with
+ * OCTEMU_NO_MODE_CHIP8, OCTEMU_NO_MODE_SCHIP or OCTEMU_NO_MODE_OCTO.
+ * @return 0 on success, 1 if the mode is not available
+ */
+int octemu_set_mode(OctEmu *, const OctEmuMode);
+
+/**
+ * Enable or disable the predecoded instruction cache.
+ * Enabled by default when memory allows. Cached entries are invalidated
+ * by memory writes (Fx33, Fx55) and by ROM load/reset.
+ * @return 0 on success, 1 on failure
+ */
+int octemu_set_predecode(OctEmu *, const bool enable);
+
+#ifdef OCTEMU_JIT
+/**
+ * Enable or disable compiling basic blocks to x86-64 code (OCTEMU_JIT builds).
+ * Disabled by default: each emulator with the JIT maps 256 KiB of code memory.
+ * Compiled blocks give the same results as the interpreter and are dropped like
+ * predecoded instructions.
+ * @return 0 on success, 1 on failure
+ */
+int octemu_set_jit(OctEmu *, const bool enable);
+#endif
+
+#ifdef OCTEMU_AOT
+/* Compiled basic block: runs its instructions on emu and *i, returns the next PC. */
+typedef uint16_t (*OctEmuBlockFunc)(OctEmu *, uint16_t *i, const uint16_t keypad);
+
+typedef struct OctEmuBlock {
+    OctEmuBlockFunc func; // NULL if no block starts here
+    uint8_t len;          // instructions
+} OctEmuBlock;
+
+/* One ROM compiled to C by aot/octemu_aot.py. */
+struct OctEmuStaticCode {
+    uint64_t rom_hash; // octemu_rom_hash() of the ROM
+    OctEmuMode mode;
+    uint16_t rom_size;
+    const OctEmuBlock *blocks; // by PC - 0x200, rom_size entries
+    const uint8_t *code_mask;  // bit n is set if ROM byte n is part of a block
+};
+
+/**
+ * Run basic blocks of the loaded ROM as native code from octemu_aot.py (OCTEMU_AOT builds),
+ * with the same results as the interpreter. The interpreter takes over when the mode changes
+ * or the ROM writes to compiled instructions, until the next reset or load of a state.
+ * @param code NULL to stop using static code
+ * @return 0 on success, 1 if code is for another ROM or mode, or its instructions were overwritten
+ */
+int octemu_set_static_code(OctEmu *, const OctEmuStaticCode *code);
+#endif
+
+/**
+ * Enable or disable skipping idle loops (enabled by default). A loop that comes back to
+ * the same registers, timers and stack without drawing or writing memory repeats until
+ * the next octemu_tick() or keypad change, so octemu_run() counts the rest of the budget
+ * as executed and stops with OCTEMU_STOP_IDLE. The emulator ends up in the same state
+ * either way; disable to time instructions.
+ */
+void octemu_set_idle_skip(OctEmu *, const bool enable);
+
+/**
+ * Seed the random numbers of Cxnn (0 for new emulators) and restart them.
+ * Runs with the same ROM, seed and keypad states give identical results.
+ */
+void octemu_set_seed(OctEmu *, const uint32_t seed);
+uint32_t octemu_get_seed(const OctEmu *);
+
+/**
+ * Drop predecoded instructions that read mem[addr..addr+len-1].
+ * Call after writing emu->mem directly.
+ */
+void octemu_invalidate(OctEmu *, const uint16_t addr, const uint16_t len);
+
+/* Copy mem[addr..addr+len-1] to buf. */
+void octemu_read_mem(const OctEmu *, const uint16_t addr, uint8_t *buf, const uint16_t len);
+
+/**
+ * Copy buf to mem[addr..addr+len-1] and drop predecoded instructions that read it.
+ * @return 0 on success, 1 if a memory page cannot be allocated (OCTEMU_PAGED_MEM)
+ */
+int octemu_write_mem(OctEmu *, const uint16_t addr, const uint8_t *buf, const uint16_t len);
+
 /* Reset emulator states and reload ROM (or empty the memory if no ROM loaded). */
 void octemu_reset(OctEmu *);
 
@@ -52,6 +249,14 @@ void octemu_reset(OctEmu *);
  */
 int octemu_eval(OctEmu *, const uint16_t keypad);
 
+/**
+ * Execute up to max_cycles instruction cycles with the same keypad state.
+ * @param max_cycles Instruction budget (tickrate)
+ * @param keypad Current keypad state bitmask
+ * @return Why the run stopped and how many cycles were executed
+ */
+OctEmuRunResult octemu_run(OctEmu *, const unsigned int max_cycles, const uint16_t keypad);
+
 /* Decrease internal timers by one. */
 void octemu_tick(OctEmu *);
 
@@ -86,7 +291,110 @@ int octemu_set_rom(OctEmu *, const uint8_t *rom_data, const size_t size);
 /* Clear current ROM. Also reset emulator states and memory. */
 void octemu_clear_rom(OctEmu *);
 
+/**
+ * Read one row of the 128x64 screen. Lowres pixels are scaled up to 2x2.
+ * @param y Row (0-63)
+ * @param row Output pixels, bit 63 of row[0] is the leftmost pixel
+ */
+void octemu_get_row(const OctEmu *, const uint8_t y, uint64_t row[2]);
+
+/**
+ * Read and clear the per-row dirty mask.
+ * @return Bitmask of changed screen rows, bit y for row y (0-63)
+ */
+uint64_t octemu_take_gfx_dirty(OctEmu *);
+
+/**
+ * Hash the 128x64 screen as returned by octemu_get_row() (64-bit FNV-1a over
+ * the row words), so equal pictures hash equal in both resolutions.
+ */
+uint64_t octemu_gfx_hash(const OctEmu *);
+
+/* Hash of the loaded ROM (64-bit FNV-1a), 0xCBF29CE484222325 if none is loaded. */
+uint64_t octemu_rom_hash(const OctEmu *);
+
+/**
+ * Write the emulator state as a versioned binary blob: registers, timers, stack,
+ * seed, memory as a delta against the ROM image and the non-blank screen rows.
+ * A blob is usually a few hundred bytes and at most OCTEMU_STATE_MAX_SIZE.
+ * @param buf Output buffer, NULL to only get the size
+ * @param size Size of buf
+ * @return Size of the blob, 0 if buf is too small
+ */
+size_t octemu_save_state(const OctEmu *, uint8_t *buf, const size_t size);
+
+/**
+ * Restore a state written by octemu_save_state(). The same ROM must be loaded;
+ * the mode is taken from the state. Redraw the whole screen after loading.
+ * @return 0 on success, 1 if the blob is invalid or for another ROM or version
+ *         (the emulator is left unchanged, or reset if a memory page cannot be
+ *         allocated with OCTEMU_PAGED_MEM)
+ */
+int octemu_load_state(OctEmu *, const uint8_t *buf, const size_t size);
+
+#ifdef OCTEMU_PROFILE
+/* Timestamp used by the profile counters (TSC ticks on x86, nanoseconds elsewhere). */
+uint64_t octemu_profile_clock(void);
+#endif
+
 /* Print emulator's current internal states (to stderr). */
 void octemu_print_states(const OctEmu *);
 
+#ifndef OCTEMU_NO_LANES
+/**
+ * Lockstep lanes (opaque): count emulators running one ROM, stored as structure
+ * of arrays. Lanes at the same PC execute each instruction together; lanes that
+ * branch apart run in separate groups until their PCs meet again. The fonts and
+ * ROM are kept once for all lanes, a lane gets a private copy of a 256-byte page
+ * of memory when it first writes to it. Left out of the build with OCTEMU_NO_LANES.
+ */
+typedef struct OctEmuLanes OctEmuLanes;
+
+/**
+ * Create count lanes in reset state.
+ * @param rom_data ROM copied into the shared memory image
+ * @return NULL on failure
+ */
+OctEmuLanes *octemu_lanes_new(const OctEmuMode mode, const unsigned int count,
+                              const uint8_t *rom_data, const size_t size);
+void octemu_lanes_free(OctEmuLanes *);
+
+/* Reset every lane, like octemu_reset(). */
+void octemu_lanes_reset(OctEmuLanes *);
+
+/* octemu_set_seed() of one lane, all lanes start with seed 0. */
+void octemu_lanes_set_seed(OctEmuLanes *, const unsigned int lane, const uint32_t seed);
+
+unsigned int octemu_lanes_count(const OctEmuLanes *);
+
+/**
+ * Run every lane for up to max_cycles instruction cycles, like octemu_run().
+ * Lanes stopped by EXIT or ERROR stay stopped until octemu_lanes_reset().
+ * @param keypads Keypad state of each lane
+ * @param stops Receives why each lane stopped (may be NULL, never OCTEMU_STOP_IDLE)
+ * @return Instruction dispatches, max_cycles if all lanes stayed in lockstep
+ */
+unsigned int octemu_lanes_run(OctEmuLanes *, const unsigned int max_cycles,
+                              const uint16_t *keypads, OctEmuStop *stops);
+
+/* Decrease the timers of every lane by one. */
+void octemu_lanes_tick(OctEmuLanes *);
+
+/* Instruction cycles executed by the lane in the last octemu_lanes_run(). */
+unsigned int octemu_lanes_cycles(const OctEmuLanes *, const unsigned int lane);
+uint8_t octemu_lanes_sound(const OctEmuLanes *, const unsigned int lane);
+
+/* octemu_get_row() of one lane. */
+void octemu_lanes_get_row(const OctEmuLanes *, const unsigned int lane, const uint8_t y, uint64_t row[2]);
+
+/* octemu_take_gfx_dirty() of one lane. */
+uint64_t octemu_lanes_take_gfx_dirty(OctEmuLanes *, const unsigned int lane);
+
+/**
+ * Copy the state and memory of one lane into emu, e.g. to continue it alone
+ * or to inspect it. The ROM of emu is left untouched.
+ */
+void octemu_lanes_get(const OctEmuLanes *, const unsigned int lane, OctEmu *emu);
+#endif // OCTEMU_NO_LANES
+
 #endif // _OCTEMU_CORE_H_
@@ -0,0 +1,402 @@
+/*
+ * x86-64 basic block compiler, included by core.c when built with OCTEMU_JIT.
+ *
+ * A block is a run of register instructions (6xNN-8xyE, Annn, Cxnn, Fx07-Fx30, Fx75,
+ * Fx85) ended by a jump (1nnn) or a skip (3x-5x, 9x, Ex9E, ExA1), which are compiled
+ * too, or by the first instruction that is not, which run() then interprets: calls,
+ * returns, Bnnn, Fx0A, drawing, memory access and anything else touching more than
+ * registers and timers. Blocks never write memory or the screen, so run() only enters
+ * one when the whole block fits in the remaining budget and no display wait is pending,
+ * and interprets the instructions one at a time otherwise. Compiled code works on the
+ * registers in OctEmu directly and returns the next PC:
+ *
+ *   uint16_t block(OctEmu *emu, uint16_t *i, uint16_t keypad)
+ */
+
+#if !defined(__x86_64__) || !defined(__unix__)
+#error "OCTEMU_JIT needs x86-64 and mmap()"
+#endif
+
+#include <sys/mman.h>
+
+#define JIT_CODE_SIZE (256 * 1024)
+#define JIT_BLOCK_MAX 32       // instructions per block
+#define JIT_INSN_CODE_MAX 160  // machine code of the longest instruction (Fx75 with 16 registers)
+#define JIT_BLOCK_CODE_MAX (JIT_BLOCK_MAX * JIT_INSN_CODE_MAX + 16)
+#define JIT_NONE 0xFF          // JitBlock.len: nothing to compile at this PC
+#define JIT_BATCH 8            // blocks per compile: the one run() enters and the ones it leads to
+
+typedef uint16_t (*jit_func)(OctEmu *, uint16_t *i, const uint16_t keypad);
+
+typedef struct JitBlock {
+    jit_func code;
+    uint8_t len;   // instructions, 0 if not compiled yet
+    uint8_t bytes; // memory the block was compiled from, starting at its PC
+} JitBlock;
+
+struct OctEmuJit {
+    uint8_t *code; // JIT_CODE_SIZE bytes, executable except while compiling
+    size_t used;
+    JitBlock blocks[OCTEMU_DECODED_SIZE]; // by PC - 0x200
+};
+
+int octemu_set_jit(OctEmu *emu, const bool enable) {
+    if (!enable) {
+        if (emu->jit) {
+            munmap(emu->jit->code, JIT_CODE_SIZE);
+            free(emu->jit);
+            emu->jit = NULL;
+        }
+        return 0;
+    }
+    if (emu->jit)
+        return 0;
+    OctEmuJit *jit = calloc(1, sizeof(OctEmuJit));
+    if (!jit)
+        return 1;
+    jit->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->code == MAP_FAILED) {
+        free(jit);
+        return 1;
+    }
+    for (int n = OCTEMU_DECODED_PCS; n < OCTEMU_DECODED_SIZE; n++)
+        jit->blocks[n].len = JIT_NONE;
+    emu->jit = jit;
+    return 0;
+}
+
+// drop all blocks and their code
+static void jit_flush(OctEmu *emu) {
+    if (!emu->jit)
+        return;
+    for (int n = 0; n < OCTEMU_DECODED_PCS; n++)
+        emu->jit->blocks[n].len = 0;
+    emu->jit->used = 0;
+}
+
+// drop blocks compiled from mem[addr]..mem[addr+len-1], their code is reclaimed by the next flush
+static void jit_invalidate(OctEmu *emu, const uint16_t addr, const uint16_t len) {
+    if (!emu->jit || addr + len <= 0x200)
+        return;
+    const uint16_t start = addr > 0x200 + JIT_BLOCK_MAX * 2 ? addr - JIT_BLOCK_MAX * 2 : 0x200;
+    for (uint16_t a = start; a < addr + len && a < OCTEMU_MEM_SIZE - 1; a++) {
+        JitBlock *b = &emu->jit->blocks[a - 0x200];
+        if (b->len && a + b->bytes > addr)
+            b->len = 0;
+    }
+}
+
+/*
+ * Instruction encoding. Registers: rdi = emu, rsi = &i, edx = keypad,
+ * eax and ecx are scratch. Operands in OctEmu are [rdi + offset].
+ */
+
+#define JIT_V(x) (offsetof(OctEmu, v) + (x))
+#define JIT_RPL(x) (offsetof(OctEmu, rpl) + (x))
+
+enum { JIT_AL = 0, JIT_CL = 1 };
+
+static inline uint8_t *emit1(uint8_t *p, const uint8_t b) {
+    *p = b;
+    return p + 1;
+}
+
+static inline uint8_t *emit2(uint8_t *p, const uint8_t b0, const uint8_t b1) {
+    p[0] = b0;
+    p[1] = b1;
+    return p + 2;
+}
+
+static inline uint8_t *emit3(uint8_t *p, const uint8_t b0, const uint8_t b1, const uint8_t b2) {
+    p[0] = b0;
+    p[1] = b1;
+    p[2] = b2;
+    return p + 3;
+}
+
+static inline uint8_t *emit_imm(uint8_t *p, const uint32_t val, const int bytes) {
+    for (int b = 0; b < bytes; b++)
+        *p++ = val >> b * 8;
+    return p;
+}
+
+// op reg, [rdi + offset] (or the other direction, as op says)
+static uint8_t *emit_rdi(uint8_t *p, const uint8_t op, const uint8_t reg, const size_t offset) {
+    *p++ = op;
+    if (offset < 0x80)
+        return emit2(p, 0x47 | reg << 3, offset);
+    *p++ = 0x87 | reg << 3;
+    return emit_imm(p, offset, 4);
+}
+
+static inline uint8_t *emit_load(uint8_t *p, const uint8_t reg, const size_t offset) {
+    return emit_rdi(p, 0x8A, reg, offset); // mov r8, [rdi + offset]
+}
+
+static inline uint8_t *emit_store(uint8_t *p, const uint8_t reg, const size_t offset) {
+    return emit_rdi(p, 0x88, reg, offset); // mov [rdi + offset], r8
+}
+
+static inline uint8_t *emit_load_zx(uint8_t *p, const uint8_t reg, const size_t offset) {
+    p = emit1(p, 0x0F);
+    return emit_rdi(p, 0xB6, reg, offset); // movzx r32, byte [rdi + offset]
+}
+
+// vx = al, vF = cl
+static inline uint8_t *emit_store_flag(uint8_t *p, const uint8_t x) {
+    p = emit_store(p, JIT_AL, JIT_V(x));
+    return emit_store(p, JIT_CL, JIT_V(0xF));
+}
+
+static inline uint8_t *emit_ret(uint8_t *p, const uint16_t pc) {
+    p = emit1(p, 0xB8); // mov eax, pc
+    p = emit_imm(p, pc, 4);
+    return emit1(p, 0xC3); // ret
+}
+
+// return pc + 4 if the flags meet cond (0F 4x cmovcc), else pc + 2
+static inline uint8_t *emit_skip(uint8_t *p, const uint16_t pc, const uint8_t cmov) {
+    p = emit1(p, 0xB8); // mov eax, pc + 2
+    p = emit_imm(p, pc + 2, 4);
+    p = emit1(p, 0xB9); // mov ecx, pc + 4
+    p = emit_imm(p, pc + 4, 4);
+    p = emit3(p, 0x0F, cmov, 0xC1); // cmovcc eax, ecx
+    return emit1(p, 0xC3);
+}
+
+#define CMOVE 0x44
+#define CMOVNE 0x45
+#define CMOVC 0x42
+#define CMOVNC 0x43
+
+/*
+ * Compile one instruction of a block at pc. Returns the end of its code, or NULL if it is
+ * not compiled. *end is set if the instruction ends the block.
+ */
+static uint8_t *jit_insn(uint8_t *p, const OctEmuInsn *d, const uint16_t pc, const OctEmuMode mode,
+                         bool *end) {
+    const bool chip8 = mode == OCTEMU_MODE_CHIP8, schip = mode == OCTEMU_MODE_SCHIP;
+    switch (d->op) {
+    case OP_JP: // jmp nnn, invalid targets are left to run() to report
+        if (d->nnn < 0x200 || d->nnn > OCTEMU_MEM_SIZE - 2)
+            return NULL;
+        *end = true;
+        return emit_ret(p, d->nnn);
+    case OP_SE_NN:
+    case OP_SNE_NN:
+        p = emit_rdi(p, 0x80, 7, JIT_V(d->x)); // cmp byte [vx], nn
+        p = emit1(p, d->nn);
+        *end = true;
+        return emit_skip(p, pc, d->op == OP_SE_NN ? CMOVE : CMOVNE);
+    case OP_SE_VY:
+    case OP_SNE_VY:
+        p = emit_load(p, JIT_AL, JIT_V(d->x));
+        p = emit_rdi(p, 0x3A, JIT_AL, JIT_V(d->y)); // cmp al, [vy]
+        *end = true;
+        return emit_skip(p, pc, d->op == OP_SE_VY ? CMOVE : CMOVNE);
+    case OP_SKP:
+    case OP_SKNP:
+        p = emit_load_zx(p, JIT_CL, JIT_V(d->x));
+        p = emit3(p, 0x83, 0xE1, 0x0F); // and ecx, 0xF
+        p = emit3(p, 0x0F, 0xA3, 0xCA); // bt edx, ecx
+        *end = true;
+        return emit_skip(p, pc, d->op == OP_SKP ? CMOVC : CMOVNC);
+    case OP_MOV_NN:
+        p = emit_rdi(p, 0xC6, 0, JIT_V(d->x)); // mov byte [vx], nn
+        return emit1(p, d->nn);
+    case OP_ADD_NN:
+        p = emit_rdi(p, 0x80, 0, JIT_V(d->x)); // add byte [vx], nn
+        return emit1(p, d->nn);
+    case OP_MOV:
+        p = emit_load(p, JIT_AL, JIT_V(d->y));
+        return emit_store(p, JIT_AL, JIT_V(d->x));
+    case OP_OR:
+    case OP_AND:
+    case OP_XOR:
+        p = emit_load(p, JIT_AL, JIT_V(d->y));
+        p = emit_rdi(p, d->op == OP_OR ? 0x08 : d->op == OP_AND ? 0x20 : 0x30, JIT_AL, JIT_V(d->x));
+        if (chip8) {
+            p = emit_rdi(p, 0xC6, 0, JIT_V(0xF)); // mov byte [vF], 0
+            p = emit1(p, 0);
+        }
+        return p;
+    case OP_ADD:
+        p = emit_load(p, JIT_AL, JIT_V(d->x));
+        p = emit_rdi(p, 0x02, JIT_AL, JIT_V(d->y)); // add al, [vy]
+        p = emit3(p, 0x0F, 0x92, 0xC1);              // setc cl
+        return emit_store_flag(p, d->x);
+    case OP_SUB:
+    case OP_SUBN: // flag is set without borrow
+        p = emit_load(p, JIT_AL, JIT_V(d->op == OP_SUB ? d->x : d->y));
+        p = emit_rdi(p, 0x2A, JIT_AL, JIT_V(d->op == OP_SUB ? d->y : d->x)); // sub al, [..]
+        p = emit3(p, 0x0F, 0x93, 0xC1);                                       // setnc cl
+        return emit_store_flag(p, d->x);
+    case OP_SHR:
+    case OP_SHL:
+        p = emit_load(p, JIT_AL, JIT_V(schip ? d->x : d->y));
+        p = emit2(p, 0xD0, d->op == OP_SHR ? 0xE8 : 0xE0); // shr/shl al, 1
+        p = emit3(p, 0x0F, 0x92, 0xC1);                    // setc cl
+        return emit_store_flag(p, d->x);
+    case OP_MOV_I:
+        p = emit3(p, 0x66, 0xC7, 0x06); // mov word [rsi], nnn
+        return emit_imm(p, d->nnn, 2);
+    case OP_ADD_I:
+        p = emit_load_zx(p, JIT_AL, JIT_V(d->x));
+        return emit3(p, 0x66, 0x01, 0x06); // add [rsi], ax
+    case OP_SPRITE:
+    case OP_SPRITE_HR:
+        p = emit_load_zx(p, JIT_AL, JIT_V(d->x));
+        p = emit3(p, 0x83, 0xE0, 0x0F); // and eax, 0xF
+        if (d->op == OP_SPRITE) {
+            p = emit3(p, 0x6B, 0xC0, 5); // imul eax, eax, 5
+        } else {
+            p = emit3(p, 0x6B, 0xC0, 10);               // imul eax, eax, 10
+            p = emit3(p, 0x83, 0xC0, sizeof(fonts.lr)); // add eax, sizeof(fonts.lr)
+        }
+        return emit3(p, 0x66, 0x89, 0x06); // mov [rsi], ax
+    case OP_RND: // xorshift32, as next_random()
+        p = emit_rdi(p, 0x8B, JIT_AL, offsetof(OctEmu, rng)); // mov eax, [rng]
+        p = emit2(p, 0x89, 0xC1);                           // mov ecx, eax
+        p = emit3(p, 0xC1, 0xE1, 13);                       // shl ecx, 13
+        p = emit2(p, 0x31, 0xC8);                           // xor eax, ecx
+        p = emit2(p, 0x89, 0xC1);
+        p = emit3(p, 0xC1, 0xE9, 17); // shr ecx, 17
+        p = emit2(p, 0x31, 0xC8);
+        p = emit2(p, 0x89, 0xC1);
+        p = emit3(p, 0xC1, 0xE1, 5); // shl ecx, 5
+        p = emit2(p, 0x31, 0xC8);
+        p = emit_rdi(p, 0x89, JIT_AL, offsetof(OctEmu, rng)); // mov [rng], eax
+        p = emit3(p, 0xC1, 0xE8, 24);                       // shr eax, 24
+        p = emit2(p, 0x24, d->nn);                          // and al, nn
+        return emit_store(p, JIT_AL, JIT_V(d->x));
+    case OP_MOV_DT_TO:
+        p = emit_load(p, JIT_AL, offsetof(OctEmu, delay));
+        return emit_store(p, JIT_AL, JIT_V(d->x));
+    case OP_MOV_DT:
+    case OP_MOV_ST:
+        p = emit_load(p, JIT_AL, JIT_V(d->x));
+        return emit_store(p, JIT_AL, d->op == OP_MOV_DT ? offsetof(OctEmu, delay) : offsetof(OctEmu, sound));
+    case OP_STORE_RPL:
+    case OP_LOAD_RPL:
+        for (uint8_t r = 0; r <= d->x; r++) {
+            p = emit_load(p, JIT_AL, d->op == OP_STORE_RPL ? JIT_V(r) : JIT_RPL(r));
+            p = emit_store(p, JIT_AL, d->op == OP_STORE_RPL ? JIT_RPL(r) : JIT_V(r));
+        }
+        return p;
+    default:
+        return NULL;
+    }
+}
+
+#undef CMOVE
+#undef CMOVNE
+#undef CMOVC
+#undef CMOVNC
+
+// run() skips delay timer wait loops in one step with the predecode cache, leave them to it
+static bool jit_wait_loop(const OctEmu *emu, const uint16_t pc) {
+    if (!emu->decoded)
+        return false;
+    OctEmuInsn d;
+    decode(mem_get(emu, pc) << 8 | mem_get(emu, pc + 1), &d);
+    fuse(emu, pc, &d);
+    return d.op == OP_WAIT_DT;
+}
+
+// Compile the block at start to code, or only measure it if code is NULL. Returns the size of
+// the code, sets *len (0 if its first instruction is not compiled) and the PCs it jumps or skips to.
+static size_t jit_block_code(const OctEmu *emu, const uint16_t start, const OctEmuMode mode, uint8_t *code,
+                               uint8_t *len, uint16_t next[2], uint8_t *next_count) {
+    uint8_t scratch[JIT_INSN_CODE_MAX], *p = code ? code : scratch;
+    OctEmuInsn d;
+    uint16_t pc = start;
+    bool end = false;
+    *len = *next_count = 0;
+    while (!end && *len < JIT_BLOCK_MAX && pc <= OCTEMU_MEM_SIZE - 2 && !(*len && jit_wait_loop(emu, pc))) {
+        decode(mem_get(emu, pc) << 8 | mem_get(emu, pc + 1), &d);
+        uint8_t *insn_end = jit_insn(p, &d, pc, mode, &end);
+        if (!insn_end)
+            break;
+        if (code)
+            p = insn_end;
+        ++*len;
+        pc += 2;
+    }
+    if (end && d.op == OP_JP) {
+        next[(*next_count)++] = d.nnn;
+    } else if (end) { // pc is past the skip
+        next[(*next_count)++] = pc;
+        next[(*next_count)++] = pc + 2;
+    }
+    if (!code)
+        return 0;
+    if (*len && !end)
+        p = emit_ret(p, pc);
+    return p - code;
+}
+
+// Compile the block at start and up to JIT_BATCH - 1 blocks it leads to, with one switch of
+// the code to writable and back. Nothing is switched if none of them can be compiled.
+static void jit_compile(OctEmu *emu, const uint16_t start, const OctEmuMode mode) {
+    OctEmuJit *jit = emu->jit;
+    if (jit->used > JIT_CODE_SIZE - JIT_BLOCK_CODE_MAX)
+        jit_flush(emu);
+    const size_t room = (JIT_CODE_SIZE - jit->used) / JIT_BLOCK_CODE_MAX;
+    // todo[0..compiled) are blocks with code to emit, todo[n..count) are yet to be measured
+    uint16_t todo[JIT_BATCH] = {start};
+    unsigned int count = 1, compiled = 0;
+    for (unsigned int n = 0; n < count; n++) {
+        const uint16_t pc = todo[n];
+        JitBlock *b = &jit->blocks[pc - 0x200];
+        b->len = JIT_NONE;
+        b->bytes = 2;
+        if (jit_wait_loop(emu, pc)) {
+            b->bytes = 6;
+            continue;
+        }
+        uint8_t len, next_count;
+        uint16_t next[2];
+        jit_block_code(emu, pc, mode, NULL, &len, next, &next_count);
+        if (!len)
+            continue;
+        if (compiled == room) { // compiled when run() gets there, after a flush
+            b->len = 0;
+            continue;
+        }
+        b->len = len; // code is set below
+        todo[compiled++] = pc;
+        for (uint8_t k = 0; k < next_count && count < JIT_BATCH; k++) {
+            bool queued = jit->blocks[next[k] - 0x200].len;
+            for (unsigned int q = n + 1; q < count && !queued; q++)
+                queued = todo[q] == next[k];
+            if (!queued)
+                todo[count++] = next[k];
+        }
+    }
+    if (!compiled)
+        return;
+    if (mprotect(jit->code, JIT_CODE_SIZE, PROT_READ | PROT_WRITE)) {
+        for (unsigned int n = 0; n < compiled; n++)
+            jit->blocks[todo[n] - 0x200].len = JIT_NONE;
+        return;
+    }
+    for (unsigned int n = 0; n < compiled; n++) {
+        JitBlock *b = &jit->blocks[todo[n] - 0x200];
+        uint8_t *const code = jit->code + jit->used, next_count;
+        uint16_t next[2];
+        const size_t size = jit_block_code(emu, todo[n], mode, code, &b->len, next, &next_count);
+        b->code = (jit_func)code;
+        b->bytes = b->len * 2;
+        jit->used += (size + 15) & ~15;
+    }
+    if (mprotect(jit->code, JIT_CODE_SIZE, PROT_READ | PROT_EXEC))
+        octemu_set_jit(emu, false); // not expected, but the code cannot run now
+}
+
+// compiled block at pc (0x200 <= pc < OCTEMU_PC_FAULT + 1), NULL if there is none
+static inline const JitBlock *jit_block(OctEmu *emu, const uint16_t pc, const OctEmuMode mode) {
+    const JitBlock *b = &emu->jit->blocks[pc - 0x200];
+    if (!b->len)
+        jit_compile(emu, pc, mode);
+    return emu->jit && b->len != JIT_NONE ? b : NULL;
+}
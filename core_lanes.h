@@ -0,0 +1,658 @@
+// Lockstep lanes: many emulators running one ROM, state kept as structure of arrays.
+// Included by core.c, shares the decoder and the drawing helpers.
+
+#define LANES_PAGE_BITS 8
+#define LANES_PAGES (OCTEMU_MEM_SIZE >> LANES_PAGE_BITS)
+#define LANES_PAGE_SIZE (1 << LANES_PAGE_BITS)
+
+typedef union LaneGfx {
+    uint64_t hr[OCTEMU_GFX_HEIGHT][OCTEMU_GFX_WIDTH / 64];
+    uint64_t lr[OCTEMU_GFX_HEIGHT / 2];
+} LaneGfx;
+
+struct OctEmuLanes {
+    OctEmuMode mode;
+    unsigned int count;
+    // memory after reset (fonts and ROM), read by every lane until it writes to a page
+    uint8_t image[OCTEMU_MEM_SIZE];
+    OctEmuInsn image_decoded[OCTEMU_DECODED_SIZE];
+    // per lane state, count elements each. V registers are 16 such arrays: v[x * count + lane]
+    uint8_t *v;
+    uint16_t *pc, *i, *prev_keypad;
+    uint8_t *sp, *delay, *sound, *hires;
+    uint64_t *gfx_dirty;
+    uint32_t *seed, *rng;
+    uint16_t (*stack)[OCTEMU_STACK_SIZE];
+    uint8_t (*rpl)[0x10];
+    LaneGfx *gfx;
+    // private copies of written pages (NULL while shared), bit p of private_pages for pages[p]
+    uint8_t *(*pages)[LANES_PAGES];
+    uint16_t *private_pages;
+    // run state: stop reason per lane (EXIT and ERROR last until reset), lanes taking part
+    // in the current run and lanes executing the current instruction
+    uint8_t *stop, *active, *mask;
+    unsigned int *cycles;
+};
+
+static inline uint8_t lane_read(const OctEmuLanes *ls, const unsigned int l, const uint16_t addr) {
+    const uint8_t *page = ls->pages[l][addr >> LANES_PAGE_BITS];
+    return page ? page[addr & (LANES_PAGE_SIZE - 1)] : ls->image[addr];
+}
+
+static inline int lane_write(OctEmuLanes *ls, const unsigned int l, const uint16_t addr, const uint8_t val) {
+    uint8_t **page = &ls->pages[l][addr >> LANES_PAGE_BITS];
+    if (!*page) {
+        *page = malloc(LANES_PAGE_SIZE);
+        if (!*page)
+            return 1;
+        memcpy(*page, ls->image + (addr & ~(LANES_PAGE_SIZE - 1)), LANES_PAGE_SIZE);
+        ls->private_pages[l] |= 1 << (addr >> LANES_PAGE_BITS);
+    }
+    (*page)[addr & (LANES_PAGE_SIZE - 1)] = val;
+    return 0;
+}
+
+OctEmuLanes *octemu_lanes_new(const OctEmuMode mode, const unsigned int count,
+                              const uint8_t *rom_data, const size_t size) {
+    if ((unsigned int)mode > OCTEMU_MODE_OCTO) {
+        fprintf(stderr, "Unsupported mode %d\n", mode);
+        return NULL;
+    }
+    if (!count || (size < 2) || (size > OCTEMU_MEM_SIZE - 0x200)) {
+        fputs("Invalid ROM size\n", stderr);
+        return NULL;
+    }
+    OctEmuLanes *ls = calloc(1, sizeof(OctEmuLanes));
+    if (!ls) {
+        fputs("Failed to create OctEmuLanes\n", stderr);
+        return NULL;
+    }
+    ls->mode = mode;
+    ls->count = count;
+    memcpy(ls->image, &fonts, sizeof(fonts));
+    memcpy(ls->image + 0x200, rom_data, size);
+
+    ls->v = calloc(count, 0x10);
+    ls->pc = calloc(count, sizeof(uint16_t));
+    ls->i = calloc(count, sizeof(uint16_t));
+    ls->prev_keypad = calloc(count, sizeof(uint16_t));
+    ls->sp = calloc(count, 1);
+    ls->delay = calloc(count, 1);
+    ls->sound = calloc(count, 1);
+    ls->hires = calloc(count, 1);
+    ls->gfx_dirty = calloc(count, sizeof(uint64_t));
+    ls->seed = calloc(count, sizeof(uint32_t));
+    ls->rng = calloc(count, sizeof(uint32_t));
+    ls->stack = calloc(count, sizeof(ls->stack[0]));
+    ls->rpl = calloc(count, sizeof(ls->rpl[0]));
+    ls->gfx = calloc(count, sizeof(LaneGfx));
+    ls->pages = calloc(count, sizeof(ls->pages[0]));
+    ls->private_pages = calloc(count, sizeof(uint16_t));
+    ls->stop = calloc(count, 1);
+    ls->active = calloc(count, 1);
+    ls->mask = calloc(count, 1);
+    ls->cycles = calloc(count, sizeof(unsigned int));
+    if (!ls->v || !ls->pc || !ls->i || !ls->prev_keypad || !ls->sp || !ls->delay || !ls->sound ||
+        !ls->hires || !ls->gfx_dirty || !ls->seed || !ls->rng || !ls->stack || !ls->rpl || !ls->gfx || !ls->pages ||
+        !ls->private_pages || !ls->stop || !ls->active || !ls->mask || !ls->cycles) {
+        fputs("Failed to create OctEmuLanes\n", stderr);
+        octemu_lanes_free(ls);
+        return NULL;
+    }
+    octemu_lanes_reset(ls);
+    return ls;
+}
+
+static void free_pages(OctEmuLanes *ls) {
+    for (unsigned int l = 0; l < ls->count; l++) {
+        for (int p = 0; ls->private_pages[l] && p < LANES_PAGES; p++) {
+            free(ls->pages[l][p]);
+            ls->pages[l][p] = NULL;
+        }
+        ls->private_pages[l] = 0;
+    }
+}
+
+void octemu_lanes_free(OctEmuLanes *ls) {
+    if (ls->pages && ls->private_pages)
+        free_pages(ls);
+    free(ls->v);
+    free(ls->pc);
+    free(ls->i);
+    free(ls->prev_keypad);
+    free(ls->sp);
+    free(ls->delay);
+    free(ls->sound);
+    free(ls->hires);
+    free(ls->gfx_dirty);
+    free(ls->seed);
+    free(ls->rng);
+    free(ls->stack);
+    free(ls->rpl);
+    free(ls->gfx);
+    free(ls->pages);
+    free(ls->private_pages);
+    free(ls->stop);
+    free(ls->active);
+    free(ls->mask);
+    free(ls->cycles);
+    free(ls);
+}
+
+void octemu_lanes_reset(OctEmuLanes *ls) {
+    const unsigned int n = ls->count;
+    free_pages(ls);
+    memset(ls->v, 0, n * 0x10);
+    memset(ls->i, 0, n * sizeof(uint16_t));
+    memset(ls->prev_keypad, 0, n * sizeof(uint16_t));
+    memset(ls->sp, 0, n);
+    memset(ls->delay, 0, n);
+    memset(ls->sound, 0, n);
+    memset(ls->hires, 0, n);
+    memset(ls->gfx_dirty, 0, n * sizeof(uint64_t));
+    memset(ls->stack, 0, n * sizeof(ls->stack[0]));
+    memset(ls->gfx, 0, n * sizeof(LaneGfx));
+    memset(ls->stop, OCTEMU_STOP_BUDGET, n);
+    for (unsigned int l = 0; l < n; l++) {
+        ls->pc[l] = 0x200;
+        ls->rng[l] = seed_state(ls->seed[l]);
+    }
+}
+
+void octemu_lanes_set_seed(OctEmuLanes *ls, const unsigned int lane, const uint32_t seed) {
+    ls->seed[lane] = seed;
+    ls->rng[lane] = seed_state(seed);
+}
+
+unsigned int octemu_lanes_count(const OctEmuLanes *ls) { return ls->count; }
+
+// clipped in chip8/schip mode, wrapped in octo mode, see clip_rows() in core_run.h
+static int lane_draw(OctEmuLanes *ls, const unsigned int l, const uint8_t vx, const uint8_t vy, uint8_t n) {
+    const bool wrap = ls->mode == OCTEMU_MODE_OCTO, wide = !n;
+    const uint8_t width = ls->hires[l] ? OCTEMU_GFX_WIDTH : OCTEMU_GFX_WIDTH / 2;
+    const uint8_t height = ls->hires[l] ? OCTEMU_GFX_HEIGHT : OCTEMU_GFX_HEIGHT / 2;
+    const uint8_t x = vx & (width - 1), y = vy & (height - 1);
+    const uint16_t addr = ls->i[l];
+    if (wide)
+        n = 16;
+    const uint8_t rows = !wrap && n > height - y ? height - y : n;
+    if (addr > OCTEMU_MEM_SIZE - rows * (wide ? 2 : 1))
+        return 1;
+    bool collision = false;
+    for (uint8_t r = 0; r < rows; r++) {
+        const uint16_t bits = wide ? lane_read(ls, l, addr + r * 2) << 8 | lane_read(ls, l, addr + r * 2 + 1)
+                                   : lane_read(ls, l, addr + r);
+        const uint8_t row = (y + r) & (height - 1);
+        if (ls->hires[l])
+            collision |= put_row_hr(ls->gfx[l].hr[row], bits, wide ? 16 : 8, x, wrap);
+        else
+            collision |= put_row_lr(&ls->gfx[l].lr[row], bits, wide ? 16 : 8, x, wrap);
+    }
+    ls->v[0xF * ls->count + l] = collision;
+    ls->gfx_dirty[l] |= ls->hires[l] ? rows_mask_hr(y, rows) : rows_mask_lr(y, rows);
+    return 0;
+}
+
+static inline void lane_error(OctEmuLanes *ls, const unsigned int l) {
+    ls->stop[l] = OCTEMU_STOP_ERROR;
+    ls->active[l] = 0;
+    ls->mask[l] = 0;
+}
+
+static void lane_clear_gfx(OctEmuLanes *ls, const unsigned int l) {
+    memset(&ls->gfx[l], 0, sizeof(LaneGfx));
+    ls->gfx_dirty[l] = OCTEMU_GFX_DIRTY_ALL;
+}
+
+unsigned int octemu_lanes_run(OctEmuLanes *ls, const unsigned int max_cycles,
+                              const uint16_t *keypads, OctEmuStop *stops) {
+    const unsigned int n = ls->count;
+    const bool chip8_mode = ls->mode == OCTEMU_MODE_CHIP8, schip_mode = ls->mode == OCTEMU_MODE_SCHIP;
+    uint8_t *restrict mask = ls->mask, *restrict active = ls->active;
+    uint16_t *restrict pc = ls->pc, *restrict i = ls->i;
+    unsigned int dispatches = 0;
+
+    for (unsigned int l = 0; l < n; l++) {
+        active[l] = ls->stop[l] < OCTEMU_STOP_EXIT && max_cycles;
+        if (active[l])
+            ls->stop[l] = OCTEMU_STOP_BUDGET;
+        ls->cycles[l] = 0;
+    }
+
+    while (true) {
+        // run the lanes with the lowest PC first, so lanes that took different
+        // branches meet again where the paths join and run together from there
+        uint16_t min_pc = UINT16_MAX;
+        for (unsigned int l = 0; l < n; l++) {
+            const uint16_t p = active[l] ? pc[l] : UINT16_MAX;
+            min_pc = p < min_pc ? p : min_pc;
+        }
+        if (min_pc == UINT16_MAX)
+            break;
+        for (unsigned int l = 0; l < n; l++)
+            mask[l] = active[l] & (pc[l] == min_pc);
+        dispatches++;
+
+        if (min_pc > OCTEMU_MEM_SIZE - 2 || min_pc < 0x200) {
+            for (unsigned int l = 0; l < n; l++) {
+                if (mask[l]) {
+                    fprintf(stderr, "PC memory access out of bound: 0x%.4X\n", min_pc);
+                    lane_error(ls, l);
+                }
+            }
+            continue;
+        }
+
+        // fetch once from the shared image unless a lane rewrote this code
+        uint16_t private = 0;
+        for (unsigned int l = 0; l < n; l++)
+            private |= mask[l] ? ls->private_pages[l] : 0;
+        OctEmuInsn insn;
+        const OctEmuInsn *d;
+        if (!(private & (1 << (min_pc >> LANES_PAGE_BITS) | 1 << ((min_pc + 1) >> LANES_PAGE_BITS)))) {
+            OctEmuInsn *cached = &ls->image_decoded[min_pc - 0x200];
+            if (cached->op == OP_NONE)
+                decode(ls->image[min_pc] << 8 | ls->image[min_pc + 1], cached);
+            d = cached;
+        } else { // lanes with other code at this PC run in a later group
+            int32_t ins = -1; // any 16-bit instruction, -1 until the first lane
+            for (unsigned int l = 0; l < n; l++) {
+                if (!mask[l])
+                    continue;
+                const uint16_t lane_ins = lane_read(ls, l, min_pc) << 8 | lane_read(ls, l, min_pc + 1);
+                if (ins < 0)
+                    ins = lane_ins;
+                mask[l] = lane_ins == ins;
+            }
+            decode(ins, &insn);
+            d = &insn;
+        }
+
+        // vx, vy and vf may be the same array, each lane reads its operands before writing
+        uint8_t *vx = ls->v + d->x * n, *vy = ls->v + d->y * n, *vf = ls->v + 0xF * n;
+        for (unsigned int l = 0; l < n; l++) {
+            pc[l] += mask[l] << 1;
+            ls->cycles[l] += mask[l];
+        }
+
+        switch (d->op) {
+        case OP_EXIT: // exit
+            for (unsigned int l = 0; l < n; l++) {
+                if (mask[l]) {
+                    ls->stop[l] = OCTEMU_STOP_EXIT;
+                    active[l] = mask[l] = 0;
+                }
+            }
+            break;
+        case OP_SCD: // scroll down by n rows
+            for (unsigned int l = 0; l < n; l++) {
+                if (!mask[l])
+                    continue;
+                LaneGfx *g = &ls->gfx[l];
+                if (ls->hires[l]) {
+                    memmove(g->hr[d->n], g->hr[0], sizeof(g->hr[0]) * (OCTEMU_GFX_HEIGHT - d->n));
+                    memset(g->hr, 0, sizeof(g->hr[0]) * d->n);
+                } else {
+                    memmove(&g->lr[d->n], &g->lr[0], sizeof(g->lr[0]) * (OCTEMU_GFX_HEIGHT / 2 - d->n));
+                    memset(g->lr, 0, sizeof(g->lr[0]) * d->n);
+                }
+                ls->gfx_dirty[l] = OCTEMU_GFX_DIRTY_ALL;
+            }
+            break;
+        case OP_CLS: // cls
+            for (unsigned int l = 0; l < n; l++) {
+                if (mask[l])
+                    lane_clear_gfx(ls, l);
+            }
+            break;
+        case OP_RET: // ret
+            for (unsigned int l = 0; l < n; l++) {
+                if (!mask[l])
+                    continue;
+                if (!ls->sp[l]) {
+                    fputs("Return from empty stack\n", stderr);
+                    lane_error(ls, l);
+                } else
+                    pc[l] = ls->stack[l][--ls->sp[l]];
+            }
+            break;
+        case OP_SCR: // scroll right by 4 pixels
+        case OP_SCL: // scroll left by 4 pixels
+            for (unsigned int l = 0; l < n; l++) {
+                if (!mask[l])
+                    continue;
+                LaneGfx *g = &ls->gfx[l];
+                if (ls->hires[l]) {
+                    for (int y = 0; y < OCTEMU_GFX_HEIGHT; y++) {
+                        uint64_t *row = g->hr[y];
+                        if (d->op == OP_SCR) {
+                            row[1] = row[1] >> 4 | row[0] << 60;
+                            row[0] >>= 4;
+                        } else {
+                            row[0] = row[0] << 4 | row[1] >> 60;
+                            row[1] <<= 4;
+                        }
+                    }
+                } else {
+                    for (int y = 0; y < OCTEMU_GFX_HEIGHT / 2; y++)
+                        g->lr[y] = d->op == OP_SCR ? g->lr[y] >> 4 : g->lr[y] << 4;
+                }
+                ls->gfx_dirty[l] = OCTEMU_GFX_DIRTY_ALL;
+            }
+            break;
+        case OP_LOW:
+        case OP_HIGH:
+            for (unsigned int l = 0; l < n; l++) {
+                if (!mask[l])
+                    continue;
+                ls->hires[l] = d->op == OP_HIGH;
+                lane_clear_gfx(ls, l);
+            }
+            break;
+        case OP_JP: // jmp nnn
+            for (unsigned int l = 0; l < n; l++)
+                pc[l] = mask[l] ? d->nnn : pc[l];
+            break;
+        case OP_CALL: // call nnn
+            for (unsigned int l = 0; l < n; l++) {
+                if (!mask[l])
+                    continue;
+                if (ls->sp[l] >= OCTEMU_STACK_SIZE) {
+                    fputs("Stack Overflow\n", stderr);
+                    lane_error(ls, l);
+                } else {
+                    ls->stack[l][ls->sp[l]++] = pc[l];
+                    pc[l] = d->nnn;
+                }
+            }
+            break;
+        case OP_SE_NN: // se vx, nn
+            for (unsigned int l = 0; l < n; l++)
+                pc[l] += (mask[l] & (vx[l] == d->nn)) << 1;
+            break;
+        case OP_SNE_NN: // sne vx, nn
+            for (unsigned int l = 0; l < n; l++)
+                pc[l] += (mask[l] & (vx[l] != d->nn)) << 1;
+            break;
+        case OP_SE_VY: // se vx, vy
+            for (unsigned int l = 0; l < n; l++)
+                pc[l] += (mask[l] & (vx[l] == vy[l])) << 1;
+            break;
+        case OP_MOV_NN: // mov vx, nn
+            for (unsigned int l = 0; l < n; l++)
+                vx[l] = mask[l] ? d->nn : vx[l];
+            break;
+        case OP_ADD_NN: // add vx, nn
+            for (unsigned int l = 0; l < n; l++)
+                vx[l] += mask[l] ? d->nn : 0;
+            break;
+        case OP_MOV: // mov vx, vy
+            for (unsigned int l = 0; l < n; l++)
+                vx[l] = mask[l] ? vy[l] : vx[l];
+            break;
+        case OP_OR: // or vx, vy
+        case OP_AND: // and vx, vy
+        case OP_XOR: // xor vx, vy
+            for (unsigned int l = 0; l < n; l++) {
+                const uint8_t r = d->op == OP_OR ? vx[l] | vy[l] : d->op == OP_AND ? vx[l] & vy[l] : vx[l] ^ vy[l];
+                vx[l] = mask[l] ? r : vx[l];
+            }
+            if (chip8_mode) {
+                for (unsigned int l = 0; l < n; l++)
+                    vf[l] = mask[l] ? 0 : vf[l];
+            }
+            break;
+        case OP_ADD: // add vx, vy
+            for (unsigned int l = 0; l < n; l++) {
+                const uint8_t a = vx[l], b = vy[l], flag = a > 0xFF - b;
+                vx[l] = mask[l] ? (uint8_t)(a + b) : a;
+                vf[l] = mask[l] ? flag : vf[l];
+            }
+            break;
+        case OP_SUB: // sub vx, vy
+            for (unsigned int l = 0; l < n; l++) {
+                const uint8_t a = vx[l], b = vy[l], flag = a >= b;
+                vx[l] = mask[l] ? (uint8_t)(a - b) : a;
+                vf[l] = mask[l] ? flag : vf[l];
+            }
+            break;
+        case OP_SHR: // shr vx (schip), shr vx, vy
+            for (unsigned int l = 0; l < n; l++) {
+                const uint8_t src = schip_mode ? vx[l] : vy[l], flag = src & 1;
+                vx[l] = mask[l] ? src >> 1 : vx[l];
+                vf[l] = mask[l] ? flag : vf[l];
+            }
+            break;
+        case OP_SUBN: // subn vx, vy
+            for (unsigned int l = 0; l < n; l++) {
+                const uint8_t a = vx[l], b = vy[l], flag = b >= a;
+                vx[l] = mask[l] ? (uint8_t)(b - a) : a;
+                vf[l] = mask[l] ? flag : vf[l];
+            }
+            break;
+        case OP_SHL: // shl vx (schip), shl vx, vy
+            for (unsigned int l = 0; l < n; l++) {
+                const uint8_t src = schip_mode ? vx[l] : vy[l], flag = src >> 7;
+                vx[l] = mask[l] ? (uint8_t)(src << 1) : vx[l];
+                vf[l] = mask[l] ? flag : vf[l];
+            }
+            break;
+        case OP_SNE_VY: // sne vx, vy
+            for (unsigned int l = 0; l < n; l++)
+                pc[l] += (mask[l] & (vx[l] != vy[l])) << 1;
+            break;
+        case OP_MOV_I: // mov I, nnn
+            for (unsigned int l = 0; l < n; l++)
+                i[l] = mask[l] ? d->nnn : i[l];
+            break;
+        case OP_JP_V0: { // jmp vx+xnn (schip), jmp v0+nnn
+            const uint8_t *base = schip_mode ? vx : ls->v;
+            for (unsigned int l = 0; l < n; l++)
+                pc[l] = mask[l] ? d->nnn + base[l] : pc[l];
+            break;
+        }
+        case OP_RND: // rnd vx, nn
+            for (unsigned int l = 0; l < n; l++) {
+                uint32_t state = ls->rng[l];
+                const uint8_t r = next_random(&state);
+                ls->rng[l] = mask[l] ? state : ls->rng[l];
+                vx[l] = mask[l] ? d->nn & r : vx[l];
+            }
+            break;
+        case OP_DRW: // mov gfx(vx, vy..), [I]..[I+n-1]
+            for (unsigned int l = 0; l < n; l++) {
+                if (mask[l] && lane_draw(ls, l, vx[l], vy[l], d->n)) {
+                    fprintf(stderr, "I memory access out of bound: 0x%.4X\n", i[l]);
+                    lane_error(ls, l);
+                }
+            }
+            break;
+        case OP_SKP: // se vx, key
+            for (unsigned int l = 0; l < n; l++)
+                pc[l] += (mask[l] & keypads[l] >> (vx[l] & 0xF)) << 1 & 2;
+            break;
+        case OP_SKNP: // sne vx, key
+            for (unsigned int l = 0; l < n; l++)
+                pc[l] += (mask[l] & ~keypads[l] >> (vx[l] & 0xF)) << 1 & 2;
+            break;
+        case OP_MOV_DT_TO: // mov vx, delay
+            for (unsigned int l = 0; l < n; l++)
+                vx[l] = mask[l] ? ls->delay[l] : vx[l];
+            break;
+        case OP_MOV_KEY: // mov vx, key
+            for (unsigned int l = 0; l < n; l++) {
+                if (!mask[l])
+                    continue;
+                const uint16_t released = ls->prev_keypad[l] & ~keypads[l];
+                if (released)
+                    vx[l] = __builtin_ctz(released);
+                else {
+                    pc[l] -= 2;
+                    ls->stop[l] = OCTEMU_STOP_KEY;
+                }
+            }
+            break;
+        case OP_MOV_DT: // mov delay, vx
+            for (unsigned int l = 0; l < n; l++)
+                ls->delay[l] = mask[l] ? vx[l] : ls->delay[l];
+            break;
+        case OP_MOV_ST: // mov sound, vx
+            for (unsigned int l = 0; l < n; l++)
+                ls->sound[l] = mask[l] ? vx[l] : ls->sound[l];
+            break;
+        case OP_ADD_I: // mov I, I+vx
+            for (unsigned int l = 0; l < n; l++)
+                i[l] += mask[l] ? vx[l] : 0;
+            break;
+        case OP_SPRITE: // mov I, &sprite(vx)
+            for (unsigned int l = 0; l < n; l++)
+                i[l] = mask[l] ? (vx[l] & 0xF) * 5 : i[l];
+            break;
+        case OP_SPRITE_HR: // mov I, &sprites_hr(vx)
+            for (unsigned int l = 0; l < n; l++)
+                i[l] = mask[l] ? sizeof(fonts.lr) + (vx[l] & 0xF) * 10 : i[l];
+            break;
+        case OP_BCD: // mov [I]..[I+2], bcd(vx)
+            for (unsigned int l = 0; l < n; l++) {
+                if (!mask[l])
+                    continue;
+                if (i[l] > OCTEMU_MEM_SIZE - 3) {
+                    fprintf(stderr, "I memory access out of bound: 0x%.4X\n", i[l]);
+                    lane_error(ls, l);
+                } else if (lane_write(ls, l, i[l], vx[l] / 100) ||
+                           lane_write(ls, l, i[l] + 1, vx[l] / 10 % 10) ||
+                           lane_write(ls, l, i[l] + 2, vx[l] % 10))
+                    lane_error(ls, l);
+            }
+            break;
+        case OP_STORE: // mov [I], v0..vx
+        case OP_LOAD: // mov v0..vx, [I]
+            for (unsigned int l = 0; l < n; l++) {
+                if (!mask[l])
+                    continue;
+                if (i[l] >= OCTEMU_MEM_SIZE - d->x) {
+                    fprintf(stderr, "I memory access out of bound: 0x%.4X\n", i[l]);
+                    lane_error(ls, l);
+                    continue;
+                }
+                for (uint8_t r = 0; r <= d->x; r++) {
+                    if (d->op == OP_LOAD)
+                        ls->v[r * n + l] = lane_read(ls, l, i[l] + r);
+                    else if (lane_write(ls, l, i[l] + r, ls->v[r * n + l])) {
+                        lane_error(ls, l);
+                        break;
+                    }
+                }
+                if (!schip_mode)
+                    i[l] += d->x + 1;
+            }
+            break;
+        case OP_STORE_RPL: // mov rpl, v0..vx
+        case OP_LOAD_RPL: // mov v0..vx, rpl
+            for (unsigned int l = 0; l < n; l++) {
+                for (uint8_t r = 0; mask[l] && r <= d->x; r++) {
+                    if (d->op == OP_STORE_RPL)
+                        ls->rpl[l][r] = ls->v[r * n + l];
+                    else
+                        ls->v[r * n + l] = ls->rpl[l][r];
+                }
+            }
+            break;
+
+    #ifdef OCTEMU_HCF
+        case OP_HCF: // hcf
+            for (unsigned int l = 0; l < n; l++) {
+                pc[l] -= mask[l] << 1;
+                ls->sound[l] = mask[l] ? 0xFF : ls->sound[l];
+            }
+            break;
+    #endif // OCTEMU_HCF
+
+        default:
+            for (unsigned int l = 0; l < n; l++) {
+                if (mask[l]) {
+                    fprintf(stderr, "Invalid instruction %.4X at 0x%.4X\n",
+                            lane_read(ls, l, pc[l] - 2) << 8 | lane_read(ls, l, pc[l] - 1), pc[l] - 2);
+                    lane_error(ls, l);
+                }
+            }
+        }
+
+        // same checks as after every instruction of octemu_run()
+        for (unsigned int l = 0; l < n; l++) {
+            if (!mask[l])
+                continue;
+            ls->prev_keypad[l] = keypads[l];
+            if (ls->stop[l] == OCTEMU_STOP_BUDGET && chip8_mode && ls->gfx_dirty[l])
+                ls->stop[l] = OCTEMU_STOP_DISPLAY;
+            if (ls->stop[l] != OCTEMU_STOP_BUDGET || ls->cycles[l] >= max_cycles)
+                active[l] = 0;
+        }
+    }
+
+    if (stops) {
+        for (unsigned int l = 0; l < n; l++)
+            stops[l] = ls->stop[l];
+    }
+    return dispatches;
+}
+
+void octemu_lanes_tick(OctEmuLanes *ls) {
+    for (unsigned int l = 0; l < ls->count; l++) {
+        ls->delay[l] -= ls->delay[l] != 0;
+        ls->sound[l] -= ls->sound[l] != 0;
+    }
+}
+
+unsigned int octemu_lanes_cycles(const OctEmuLanes *ls, const unsigned int lane) {
+    return ls->cycles[lane];
+}
+
+uint8_t octemu_lanes_sound(const OctEmuLanes *ls, const unsigned int lane) { return ls->sound[lane]; }
+
+void octemu_lanes_get_row(const OctEmuLanes *ls, const unsigned int lane, const uint8_t y, uint64_t row[2]) {
+    if (ls->hires[lane]) {
+        row[0] = ls->gfx[lane].hr[y][0];
+        row[1] = ls->gfx[lane].hr[y][1];
+    } else {
+        const uint64_t lr = ls->gfx[lane].lr[y >> 1];
+        row[0] = expand_uint32(lr >> 32);
+        row[1] = expand_uint32(lr & 0xFFFFFFFF);
+    }
+}
+
+uint64_t octemu_lanes_take_gfx_dirty(OctEmuLanes *ls, const unsigned int lane) {
+    const uint64_t dirty = ls->gfx_dirty[lane];
+    ls->gfx_dirty[lane] = 0;
+    return dirty;
+}
+
+void octemu_lanes_get(const OctEmuLanes *ls, const unsigned int lane, OctEmu *emu) {
+    const unsigned int n = ls->count;
+    emu->mode = ls->mode;
+    emu->pc = ls->pc[lane];
+    emu->i = ls->i[lane];
+    for (int x = 0; x < 0x10; x++)
+        emu->v[x] = ls->v[x * n + lane];
+    emu->sp = ls->sp[lane];
+    emu->delay = ls->delay[lane];
+    emu->sound = ls->sound[lane];
+    emu->hires = ls->hires[lane];
+    emu->keypad = ls->prev_keypad[lane];
+    emu->gfx_dirty = ls->gfx_dirty[lane];
+    emu->seed = ls->seed[lane];
+    emu->rng = ls->rng[lane];
+    memcpy(emu->stack, ls->stack[lane], sizeof(emu->stack));
+    uint8_t mem[OCTEMU_MEM_SIZE];
+    for (int p = 0; p < LANES_PAGES; p++) {
+        const uint8_t *page = ls->pages[lane][p];
+        memcpy(mem + p * LANES_PAGE_SIZE, page ? page : ls->image + p * LANES_PAGE_SIZE, LANES_PAGE_SIZE);
+    }
+    set_mem(emu, mem);
+    memcpy(&emu->gfx, &ls->gfx[lane], sizeof(emu->gfx));
+    memcpy(emu->rpl, ls->rpl[lane], sizeof(emu->rpl));
+    clear_decoded(emu);
+#ifdef OCTEMU_AOT
+    check_static_code(emu);
+#endif
+}
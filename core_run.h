@@ -0,0 +1,550 @@
+/*
+ * Interpreter template. core.c includes this file once per quirk mode with
+ * OCTEMU_TMPL_MODE set to that mode and OCTEMU_TMPL(name) giving the
+ * mode-specific function names, so all quirk checks fold to constants.
+ */
+
+#define chip8_mode (OCTEMU_TMPL_MODE == OCTEMU_MODE_CHIP8)
+#define schip_mode (OCTEMU_TMPL_MODE == OCTEMU_MODE_SCHIP)
+#define octo_mode (OCTEMU_TMPL_MODE == OCTEMU_MODE_OCTO)
+
+#define clip_rows OCTEMU_TMPL(clip_rows)
+#define draw8hr OCTEMU_TMPL(draw8hr)
+#define draw16hr OCTEMU_TMPL(draw16hr)
+#define draw8lr OCTEMU_TMPL(draw8lr)
+#define draw16lr OCTEMU_TMPL(draw16lr)
+#define run OCTEMU_TMPL(run)
+
+// a fused op of n instructions runs as one if the budget covers it and no display wait falls inside
+#define fusable(n) (res.cycles + (n) - 1 <= max_cycles && !(chip8_mode && emu->gfx_dirty))
+
+// after a backward jump to target: an idle loop goes round for the rest of the budget at once
+#define skip_idle(target)                                                                         \
+    do {                                                                                          \
+        const unsigned int period = idle_period(&probe, emu, target, i, res.cycles, effects);     \
+        if (period) {                                                                             \
+            res.cycles += (max_cycles - res.cycles) / period * period;                            \
+            idle = true;                                                                          \
+        }                                                                                         \
+    } while (0)
+
+// sprite rows that fit on screen starting at row y (all rows wrap around in octo mode)
+static inline uint8_t clip_rows(const uint8_t y, const uint8_t n, const uint8_t height) {
+    if (octo_mode)
+        return n;
+    const uint8_t max_row = height - y;
+    return n > max_row ? max_row : n;
+}
+
+static int draw8hr(OctEmu *emu, const uint16_t addr, const uint8_t vx, const uint8_t vy, const uint8_t n) {
+    const uint8_t x = vx & (OCTEMU_GFX_WIDTH - 1), y = vy & (OCTEMU_GFX_HEIGHT - 1);
+    const uint8_t rows = clip_rows(y, n, OCTEMU_GFX_HEIGHT);
+    if (addr > OCTEMU_MEM_SIZE - rows)
+        return 1;
+    bool collision = false;
+    for (uint8_t r = 0; r < rows; r++) {
+        uint64_t *row = emu->gfx.hr[(y + r) & (OCTEMU_GFX_HEIGHT - 1)];
+        collision |= put_row_hr(row, mem_get(emu, addr + r), 8, x, octo_mode);
+    }
+    emu->v[0xF] = collision;
+    emu->gfx_dirty |= rows_mask_hr(y, rows);
+    return 0;
+}
+
+static int draw16hr(OctEmu *emu, const uint16_t addr, const uint8_t vx, const uint8_t vy) {
+    const uint8_t x = vx & (OCTEMU_GFX_WIDTH - 1), y = vy & (OCTEMU_GFX_HEIGHT - 1);
+    const uint8_t rows = clip_rows(y, 16, OCTEMU_GFX_HEIGHT);
+    if (addr > OCTEMU_MEM_SIZE - rows * 2)
+        return 1;
+    bool collision = false;
+    for (uint8_t r = 0; r < rows; r++) {
+        uint64_t *row = emu->gfx.hr[(y + r) & (OCTEMU_GFX_HEIGHT - 1)];
+        const uint16_t bits = mem_get(emu, addr + r * 2) << 8 | mem_get(emu, addr + r * 2 + 1);
+        collision |= put_row_hr(row, bits, 16, x, octo_mode);
+    }
+    emu->v[0xF] = collision;
+    emu->gfx_dirty |= rows_mask_hr(y, rows);
+    return 0;
+}
+
+static int draw8lr(OctEmu *emu, const uint16_t addr, const uint8_t vx, const uint8_t vy, const uint8_t n) {
+    const uint8_t x = vx & (OCTEMU_GFX_WIDTH / 2 - 1), y = vy & (OCTEMU_GFX_HEIGHT / 2 - 1);
+    const uint8_t rows = clip_rows(y, n, OCTEMU_GFX_HEIGHT / 2);
+    if (addr > OCTEMU_MEM_SIZE - rows)
+        return 1;
+    bool collision = false;
+    for (uint8_t r = 0; r < rows; r++) {
+        uint64_t *row = &emu->gfx.lr[(y + r) & (OCTEMU_GFX_HEIGHT / 2 - 1)];
+        collision |= put_row_lr(row, mem_get(emu, addr + r), 8, x, octo_mode);
+    }
+    emu->v[0xF] = collision;
+    emu->gfx_dirty |= rows_mask_lr(y, rows);
+    return 0;
+}
+
+static int draw16lr(OctEmu *emu, const uint16_t addr, const uint8_t vx, const uint8_t vy) {
+    const uint8_t x = vx & (OCTEMU_GFX_WIDTH / 2 - 1), y = vy & (OCTEMU_GFX_HEIGHT / 2 - 1);
+    const uint8_t rows = clip_rows(y, 16, OCTEMU_GFX_HEIGHT / 2);
+    if (addr > OCTEMU_MEM_SIZE - rows * 2)
+        return 1;
+    bool collision = false;
+    for (uint8_t r = 0; r < rows; r++) {
+        uint64_t *row = &emu->gfx.lr[(y + r) & (OCTEMU_GFX_HEIGHT / 2 - 1)];
+        const uint16_t bits = mem_get(emu, addr + r * 2) << 8 | mem_get(emu, addr + r * 2 + 1);
+        collision |= put_row_lr(row, bits, 16, x, octo_mode);
+    }
+    emu->v[0xF] = collision;
+    emu->gfx_dirty |= rows_mask_lr(y, rows);
+    return 0;
+}
+
+static OctEmuRunResult run(OctEmu *emu, const unsigned int max_cycles, const uint16_t keypad) {
+    OctEmuRunResult res = {OCTEMU_STOP_BUDGET, 0};
+    uint16_t fault_pc = emu->pc;
+    uint16_t pc = check_pc(emu->pc, &fault_pc), i = emu->i, prev_keypad = emu->keypad;
+    IdleProbe probe = IDLE_PROBE_INIT;
+    unsigned int effects = 0; // drawing and memory writes
+    bool idle = false;
+    while (res.cycles < max_cycles) {
+        // pc is at least 0x200 here, the sentinels past 0xFFE catch the rest
+#ifdef OCTEMU_AOT
+        if (emu->static_active && pc - 0x200 < emu->static_code->rom_size) {
+            const OctEmuBlock *b = &emu->static_code->blocks[pc - 0x200];
+            if (b->func && res.cycles + b->len <= max_cycles && !(chip8_mode && emu->gfx_dirty)) {
+                const uint16_t start = pc;
+                pc = b->func(emu, &i, keypad);
+                res.cycles += b->len;
+                prev_keypad = keypad;
+                if (pc < start + b->len * 2 && emu->idle_skip)
+                    skip_idle(pc);
+                continue;
+            }
+        }
+#endif
+#ifdef OCTEMU_JIT
+        const JitBlock *b;
+        if (emu->jit && (b = jit_block(emu, pc, OCTEMU_TMPL_MODE)) && res.cycles + b->len <= max_cycles &&
+            !(chip8_mode && emu->gfx_dirty)) {
+            const uint16_t start = pc;
+            pc = b->code(emu, &i, keypad);
+            res.cycles += b->len;
+            prev_keypad = keypad;
+            if (pc < start + b->len * 2 && emu->idle_skip)
+                skip_idle(pc);
+            continue;
+        }
+#endif
+        OctEmuInsn insn;
+        const OctEmuInsn *d;
+        if (emu->decoded) {
+            OctEmuInsn *cached = &emu->decoded[pc - 0x200];
+            if (cached->op == OP_NONE) {
+                decode(mem_get(emu, pc) << 8 | mem_get(emu, pc + 1), cached);
+                fuse(emu, pc, cached);
+            }
+            d = cached;
+        } else {
+            if (pc > OCTEMU_MEM_SIZE - 2)
+                insn.op = OP_BAD_PC;
+            else
+                decode(mem_get(emu, pc) << 8 | mem_get(emu, pc + 1), &insn);
+            d = &insn;
+        }
+        pc += 2;
+        ++res.cycles;
+        uint8_t *vx, *vy, flag;
+    dispatch:
+        vx = &emu->v[d->x];
+        vy = &emu->v[d->y];
+        switch (d->op) {
+        case OP_BAD_PC: // fetch past the end of memory or at an invalid jump target
+            pc -= 2;
+            --res.cycles;
+            if (pc == OCTEMU_PC_FAULT)
+                pc = fault_pc;
+            fprintf(stderr, "PC memory access out of bound: 0x%.4X\n", pc);
+            goto err;
+        case OP_EXIT: // exit
+            res.stop = OCTEMU_STOP_EXIT;
+            goto out;
+        case OP_SCD: { // scroll down by n rows
+            if (emu->hires) {
+                memmove(emu->gfx.hr[d->n], emu->gfx.hr[0],
+                        sizeof(emu->gfx.hr[0]) * (OCTEMU_GFX_HEIGHT - d->n));
+                memset(emu->gfx.hr, 0, sizeof(emu->gfx.hr[0]) * d->n);
+            } else {
+                memmove(&emu->gfx.lr[d->n], &emu->gfx.lr[0],
+                        sizeof(emu->gfx.lr[0]) * (OCTEMU_GFX_HEIGHT / 2 - d->n));
+                memset(emu->gfx.lr, 0, sizeof(emu->gfx.lr[0]) * d->n);
+            }
+            emu->gfx_dirty = OCTEMU_GFX_DIRTY_ALL;
+            ++effects;
+            break;
+        }
+        case OP_CLS: // cls
+            clear_gfx(emu);
+            emu->gfx_dirty = OCTEMU_GFX_DIRTY_ALL;
+            ++effects;
+            break;
+        case OP_RET: // ret
+            if (!emu->sp) {
+                fputs("Return from empty stack\n", stderr);
+                goto err;
+            }
+            pc = check_pc(emu->stack[--emu->sp], &fault_pc);
+            break;
+        case OP_SCR: // scroll right by 4 pixels
+            if (emu->hires) {
+                for (int y = 0; y < OCTEMU_GFX_HEIGHT; y++) {
+                    uint64_t *row = emu->gfx.hr[y];
+                    row[1] = row[1] >> 4 | row[0] << 60;
+                    row[0] >>= 4;
+                }
+            } else {
+                for (int y = 0; y < OCTEMU_GFX_HEIGHT / 2; y++)
+                    emu->gfx.lr[y] >>= 4;
+            }
+            emu->gfx_dirty = OCTEMU_GFX_DIRTY_ALL;
+            ++effects;
+            break;
+        case OP_SCL: // scroll left by 4 pixels
+            if (emu->hires) {
+                for (int y = 0; y < OCTEMU_GFX_HEIGHT; y++) {
+                    uint64_t *row = emu->gfx.hr[y];
+                    row[0] = row[0] << 4 | row[1] >> 60;
+                    row[1] <<= 4;
+                }
+            } else {
+                for (int y = 0; y < OCTEMU_GFX_HEIGHT / 2; y++)
+                    emu->gfx.lr[y] <<= 4;
+            }
+            emu->gfx_dirty = OCTEMU_GFX_DIRTY_ALL;
+            ++effects;
+            break;
+        case OP_LOW:
+            emu->hires = false;
+            clear_gfx(emu);
+            emu->gfx_dirty = OCTEMU_GFX_DIRTY_ALL;
+            ++effects;
+            break;
+        case OP_HIGH:
+            emu->hires = true;
+            clear_gfx(emu);
+            emu->gfx_dirty = OCTEMU_GFX_DIRTY_ALL;
+            ++effects;
+            break;
+        case OP_JP: // jmp nnn
+            if (d->nnn < pc && emu->idle_skip)
+                skip_idle(d->nnn);
+            pc = check_pc(d->nnn, &fault_pc);
+            break;
+        case OP_CALL: // call nnn
+            if (emu->sp >= OCTEMU_STACK_SIZE) {
+                fputs("Stack Overflow\n", stderr);
+                goto err;
+            }
+            emu->stack[emu->sp++] = pc;
+            pc = check_pc(d->nnn, &fault_pc);
+            break;
+        case OP_SE_NN: // se vx, nn
+            if (*vx == d->nn)
+                pc += 2;
+            break;
+        case OP_SNE_NN: // sne vx, nn
+            if (*vx != d->nn)
+                pc += 2;
+            break;
+        case OP_SE_VY: // se vx, vy
+            if (*vx == *vy)
+                pc += 2;
+            break;
+        case OP_MOV_NN: // mov vx, nn
+            *vx = d->nn;
+            break;
+        case OP_ADD_NN: // add vx, nn
+            *vx += d->nn;
+            break;
+        case OP_MOV: // mov vx, vy
+            *vx = *vy;
+            break;
+        case OP_OR: // or vx, vy
+            *vx |= *vy;
+            if (chip8_mode)
+                emu->v[0xF] = 0;
+            break;
+        case OP_AND: // and vx, vy
+            *vx &= *vy;
+            if (chip8_mode)
+                emu->v[0xF] = 0;
+            break;
+        case OP_XOR: // xor vx, vy
+            *vx ^= *vy;
+            if (chip8_mode)
+                emu->v[0xF] = 0;
+            break;
+        case OP_ADD: // add vx, vy
+            flag = *vx > 0xFF - *vy;
+            *vx += *vy;
+            emu->v[0xF] = flag;
+            break;
+        case OP_SUB: // sub vx, vy
+            flag = *vx >= *vy;
+            *vx -= *vy;
+            emu->v[0xF] = flag;
+            break;
+        case OP_SHR:
+            if (schip_mode) { // shr vx
+                flag = *vx & 1;
+                *vx >>= 1;
+            } else { // shr vx, vy
+                flag = *vy & 1;
+                *vx = *vy >> 1;
+            }
+            emu->v[0xF] = flag;
+            break;
+        case OP_SUBN: // subn vx, vy
+            flag = *vy >= *vx;
+            *vx = *vy - *vx;
+            emu->v[0xF] = flag;
+            break;
+        case OP_SHL:
+            if (schip_mode) { // shl vx
+                flag = *vx >> 7;
+                *vx <<= 1;
+            } else { // shl vx, vy
+                flag = *vy >> 7;
+                *vx = *vy << 1;
+            }
+            emu->v[0xF] = flag;
+            break;
+        case OP_SNE_VY: // sne vx, vy
+            if (*vx != *vy)
+                pc += 2;
+            break;
+        case OP_MOV_I: // mov I, nnn
+            i = d->nnn;
+            break;
+        case OP_JP_V0:
+            if (schip_mode)
+                pc = check_pc(d->nnn + *vx, &fault_pc); // jmp vx+xnn
+            else
+                pc = check_pc(d->nnn + emu->v[0], &fault_pc); // jmp v0+nnn
+            break;
+        case OP_RND: // rnd vx, nn
+            *vx = d->nn & next_random(&emu->rng);
+            break;
+        case OP_MOV_I_DRW: // mov I, nnn; drw vx, vy, n
+            if (!fusable(2))
+                goto unfuse;
+            i = d->nnn;
+            pc += 2;
+            ++res.cycles;
+            // fall through
+        case OP_DRW: { // mov gfx(vx, vy..), [I]..[I+n-1]
+#ifdef OCTEMU_PROFILE
+            const uint64_t profile_start = emu->profile.enabled ? octemu_profile_clock() : 0;
+#endif
+            if (!d->n) {
+                if (emu->hires) {
+                    if (draw16hr(emu, i, *vx, *vy))
+                        goto err_i_memory;
+                } else {
+                    if (draw16lr(emu, i, *vx, *vy))
+                        goto err_i_memory;
+                }
+            } else {
+                if (emu->hires) {
+                    if (draw8hr(emu, i, *vx, *vy, d->n))
+                        goto err_i_memory;
+                } else {
+                    if (draw8lr(emu, i, *vx, *vy, d->n))
+                        goto err_i_memory;
+                }
+            }
+#ifdef OCTEMU_PROFILE
+            if (emu->profile.enabled) {
+                emu->profile.draws++;
+                emu->profile.draw_ticks += octemu_profile_clock() - profile_start;
+            }
+#endif
+            ++effects;
+            break;
+        }
+        case OP_SKP: // se vx, key
+            if (keypad & 1 << (*vx & 0xF))
+                pc += 2;
+            break;
+        case OP_SKNP: // sne vx, key
+            if (!(keypad & 1 << (*vx & 0xF)))
+                pc += 2;
+            break;
+        case OP_MOV_DT_TO: // mov vx, delay
+            *vx = emu->delay;
+            break;
+        case OP_MOV_KEY: // mov vx, key
+            if (prev_keypad & ~keypad) { // detect released
+                for (int k = 0; k < 16; k++) {
+                    if (prev_keypad & ~keypad & 1 << k) {
+                        *vx = k;
+                        break;
+                    }
+                }
+            } else {
+                pc -= 2;
+                res.stop = OCTEMU_STOP_KEY;
+            }
+            break;
+        case OP_MOV_DT: // mov delay, vx
+            emu->delay = *vx;
+            break;
+        case OP_MOV_ST: // mov sound, vx
+            emu->sound = *vx;
+            break;
+        case OP_ADD_I: // mov I, I+vx
+            i += *vx;
+            break;
+        case OP_SPRITE: // mov I, &sprite(vx)
+            i = 0 + (*vx & 0xF) * 5;
+            break;
+        case OP_SPRITE_HR: // mov I, &sprites_hr(vx)
+            i = sizeof(fonts.lr) + (*vx & 0xF) * 10;
+            break;
+        case OP_BCD: // mov [I]..[I+2], bcd(vx)
+            if (i > OCTEMU_MEM_SIZE - 3)
+                goto err_i_memory;
+            const uint8_t bcd[3] = {*vx / 100, *vx / 10 % 10, *vx % 10};
+            if (mem_write(emu, i, bcd, 3))
+                goto err;
+            invalidate_decoded(emu, i, 3);
+            ++effects;
+            break;
+        case OP_STORE: // mov [I], v0..vx
+            if (i >= OCTEMU_MEM_SIZE - d->x)
+                goto err_i_memory;
+            if (mem_write(emu, i, emu->v, d->x + 1))
+                goto err;
+            invalidate_decoded(emu, i, d->x + 1);
+            ++effects;
+            if (!schip_mode)
+                i += d->x + 1;
+            break;
+        case OP_LOAD: // mov v0..vx, [I]
+            if (i >= OCTEMU_MEM_SIZE - d->x)
+                goto err_i_memory;
+            mem_read(emu, i, emu->v, d->x + 1);
+            if (!schip_mode)
+                i += d->x + 1;
+            break;
+        case OP_STORE_RPL: // mov rpl, v0..vx
+            memcpy(emu->rpl, emu->v, (d->x + 1) * sizeof(uint8_t));
+            break;
+        case OP_LOAD_RPL: // mov v0..vx, rpl
+            memcpy(emu->v, emu->rpl, (d->x + 1) * sizeof(uint8_t));
+            break;
+
+    #ifdef OCTEMU_HCF
+        case OP_HCF: // hcf
+            pc -= 2;
+            emu->sound = 0xFF;
+            break;
+    #endif // OCTEMU_HCF
+
+        case OP_ADD_SE: // add vx, nn; se vy, mm
+            if (!fusable(2))
+                goto unfuse;
+            *vx += d->nn;
+            pc += *vy == d->n ? 4 : 2;
+            ++res.cycles;
+            break;
+        case OP_ADD_SNE: // add vx, nn; sne vy, mm
+            if (!fusable(2))
+                goto unfuse;
+            *vx += d->nn;
+            pc += *vy != d->n ? 4 : 2;
+            ++res.cycles;
+            break;
+        case OP_MOV_MOV: // mov vx, nn; mov vy, mm
+            if (!fusable(2))
+                goto unfuse;
+            *vx = d->nn;
+            *vy = d->n;
+            pc += 2;
+            ++res.cycles;
+            break;
+        case OP_WAIT_DT: // mov vx, delay; se vx, 0; jmp back
+            if (!fusable(3))
+                goto unfuse;
+            *vx = emu->delay;
+            if (!emu->delay) { // skip the jump
+                pc += 4;
+                ++res.cycles;
+            } else if (emu->idle_skip) { // the delay timer does not change during a run: spin off the budget
+                res.cycles += (max_cycles - res.cycles + 1) / 3 * 3 - 1;
+                pc -= 2;
+                idle = true;
+            } else { // once round the loop
+                res.cycles += 2;
+                pc -= 2;
+            }
+            break;
+
+        default:
+            goto err_invalid_ins;
+
+        unfuse: // run the first instruction of a fused op alone
+            insn = *d;
+            insn.op = d->base;
+            d = &insn;
+            goto dispatch;
+        }
+        prev_keypad = keypad;
+        if (res.stop != OCTEMU_STOP_BUDGET)
+            break;
+        if (chip8_mode && emu->gfx_dirty) {
+            res.stop = OCTEMU_STOP_DISPLAY;
+            break;
+        }
+    }
+    if (idle && res.stop == OCTEMU_STOP_BUDGET)
+        res.stop = OCTEMU_STOP_IDLE;
+out:
+    emu->pc = pc == OCTEMU_PC_FAULT ? fault_pc : pc;
+    emu->i = i;
+    emu->keypad = prev_keypad;
+    return res;
+
+err_invalid_ins:
+    fprintf(stderr, "Invalid instruction %.4X at 0x%.4X\n",
+            mem_get(emu, pc - 2) << 8 | mem_get(emu, pc - 1), pc - 2);
+    goto err;
+
+err_i_memory:
+    fprintf(stderr, "I memory access out of bound: 0x%.4X\n", i);
+    goto err;
+
+err:
+    emu->pc = pc;
+    emu->i = i;
+    emu->keypad = prev_keypad;
+#ifdef OCTEMU_DEBUG
+    octemu_print_states(emu);
+#endif
+    res.stop = OCTEMU_STOP_ERROR;
+    return res;
+}
+
+#undef skip_idle
+#undef fusable
+#undef run
+#undef draw16lr
+#undef draw8lr
+#undef draw16hr
+#undef draw8hr
+#undef clip_rows
+
+#undef octo_mode
+#undef schip_mode
+#undef chip8_mode
+
+#undef OCTEMU_TMPL
+#undef OCTEMU_TMPL_MODE
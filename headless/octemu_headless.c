@@ -0,0 +1,539 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../batch.h"
+#include "../core.h"
+#include "../movie.h"
+
+#ifndef OCTEMU_TICKRATE_CHIP8
+#define OCTEMU_TICKRATE_CHIP8 15
+#endif
+#ifndef OCTEMU_TICKRATE_SCHIP
+#define OCTEMU_TICKRATE_SCHIP 200
+#endif
+#ifndef OCTEMU_VERSION
+#define OCTEMU_VERSION "dev"
+#endif
+
+#define FORMAT_PBM 0
+#define FORMAT_PGM 1
+#define FORMAT_RAW 2
+#define FORMAT_HASH 3
+
+// keypad state from frame onwards
+typedef struct Input {
+    unsigned long frame;
+    uint16_t keypad;
+} Input;
+
+/**
+ * Input script: one "<frame> <keypad>" pair per line, keypad is a hex bitmask
+ * (bit k for key k) held from that frame until the next entry. Frames must not
+ * decrease. Empty lines and lines starting with '#' are ignored.
+ */
+static Input *load_inputs(const char *path, size_t *count) {
+    FILE *f = strcmp(path, "-") ? fopen(path, "r") : stdin;
+    if (!f) {
+        perror("Failed to open input script");
+        return NULL;
+    }
+    Input *inputs = NULL;
+    size_t n = 0, cap = 0;
+    char line[256];
+    for (unsigned int lineno = 1; fgets(line, sizeof(line), f); lineno++) {
+        const char *p = line + strspn(line, " \t");
+        if (*p == '#' || *p == '\n' || *p == '\r' || !*p)
+            continue;
+        unsigned long frame;
+        unsigned int keypad;
+        if (sscanf(p, "%lu %x", &frame, &keypad) != 2 || keypad > 0xFFFF ||
+            (n && frame < inputs[n - 1].frame)) {
+            fprintf(stderr, "Invalid input script line %u\n", lineno);
+            goto err;
+        }
+        if (n == cap) {
+            cap = cap ? cap * 2 : 64;
+            Input *tmp = realloc(inputs, cap * sizeof(Input));
+            if (!tmp)
+                goto err;
+            inputs = tmp;
+        }
+        inputs[n++] = (Input){frame, (uint16_t)keypad};
+    }
+    if (f != stdin)
+        fclose(f);
+    *count = n;
+    return inputs ? inputs : calloc(1, sizeof(Input));
+
+err:
+    if (f != stdin)
+        fclose(f);
+    free(inputs);
+    return NULL;
+}
+
+// per session position in the shared input script
+typedef struct InputCursor {
+    const Input *inputs;
+    size_t count, next;
+    uint16_t keypad;
+} InputCursor;
+
+static uint16_t cursor_input(void *user, const OctEmu *emu, const unsigned long frame) {
+    InputCursor *c = user;
+    while (c->next < c->count && c->inputs[c->next].frame <= frame)
+        c->keypad = c->inputs[c->next++].keypad;
+    return c->keypad;
+}
+
+static uint8_t *read_file(const char *path, const size_t max_size, size_t *size) {
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return NULL;
+    uint8_t *data = malloc(max_size);
+    *size = data ? fread(data, 1, max_size, f) : 0;
+    fclose(f);
+    return data;
+}
+
+#ifdef OCTEMU_AOT
+// ROMs recompiled into this build (OCTEMU_AOT_ROMS, _aot_roms.c)
+extern const OctEmuStaticCode *const octemu_aot_roms[];
+extern const unsigned int octemu_aot_roms_count;
+
+// run the loaded ROM as native code if it is one of them
+static void use_static_code(OctEmu *emu) {
+    for (unsigned int n = 0; n < octemu_aot_roms_count; n++) {
+        if (!octemu_set_static_code(emu, octemu_aot_roms[n]))
+            return;
+    }
+}
+#endif
+
+// run every ROM as a session of one batch and print "<hash>  <rom>" lines in order
+static int run_batch(char *roms[], const int count, const OctEmuMode mode, const int tickrate,
+                     const unsigned long frames, const unsigned int threads, const uint32_t seed,
+                     const bool jit, const Input *inputs, const size_t input_count, FILE *out) {
+    int ret = 1;
+    uint8_t **data = calloc(count, sizeof(uint8_t *));
+    InputCursor *cursors = calloc(count, sizeof(InputCursor));
+    OctEmuBatch *batch = octemu_batch_new(threads);
+    if (!data || !cursors || !batch)
+        goto out;
+    for (int n = 0; n < count; n++) {
+        size_t size;
+        OctEmuSession *s = NULL;
+        if ((data[n] = read_file(roms[n], OCTEMU_MEM_SIZE, &size)))
+            s = octemu_batch_add(batch, mode, data[n], size, tickrate, frames);
+        if (!s) {
+            fprintf(stderr, "Failed to load ROM %s\n", roms[n]);
+            goto out;
+        }
+        octemu_set_seed(s->emu, seed);
+#ifdef OCTEMU_JIT
+        if (jit && octemu_set_jit(s->emu, true))
+            fputs("JIT not available, interpreting\n", stderr);
+#endif
+#ifdef OCTEMU_AOT
+        use_static_code(s->emu);
+#endif
+        cursors[n] = (InputCursor){inputs, input_count, 0, 0};
+        s->input = cursor_input;
+        s->user = &cursors[n];
+    }
+    if (octemu_batch_run(batch, 0))
+        goto out;
+    ret = 0;
+    for (int n = 0; n < count; n++) {
+        const OctEmuSession *s = octemu_batch_session(batch, n);
+        if (s->stop == OCTEMU_STOP_ERROR) {
+            fprintf(out, "%-16s  %s\n", "error", roms[n]);
+            ret = 1;
+        } else
+            fprintf(out, "%016llx  %s\n", (unsigned long long)octemu_gfx_hash(s->emu), roms[n]);
+    }
+
+out:
+    if (batch)
+        octemu_batch_free(batch);
+    for (int n = 0; data && n < count; n++)
+        free(data[n]);
+    free(data);
+    free(cursors);
+    return ret;
+}
+
+#ifndef OCTEMU_NO_LANES
+// run the ROM of emu in count lockstep lanes and in count single emulators, with seeds
+// seed, seed + 1, ..., and compare stop reasons, cycles and whole states after every frame
+static int check_lanes(const OctEmu *emu, const unsigned int count, const int tickrate,
+                       const unsigned long frames, const uint32_t seed, const bool jit,
+                       const Input *inputs, const size_t input_count) {
+    int ret = 1;
+    OctEmuLanes *ls = octemu_lanes_new(emu->mode, count, emu->rom, emu->rom_size);
+    OctEmu **emus = calloc(count, sizeof(OctEmu *));
+    OctEmu *lane = octemu_new(emu->mode); // a lane copied out by octemu_lanes_get()
+    uint16_t *keypads = calloc(count, sizeof(uint16_t));
+    OctEmuStop *stops = calloc(count, sizeof(OctEmuStop));
+    bool *stopped = calloc(count, sizeof(bool)); // lanes stay stopped after EXIT or ERROR
+    if (!ls || !emus || !lane || !keypads || !stops || !stopped || octemu_clone(lane, emu))
+        goto out;
+    for (unsigned int l = 0; l < count; l++) {
+        if (!(emus[l] = octemu_new(emu->mode)) || octemu_clone(emus[l], emu))
+            goto out;
+        octemu_set_seed(emus[l], seed + l);
+        octemu_set_idle_skip(emus[l], false); // lanes run idle loops too
+#ifdef OCTEMU_JIT
+        if (jit && octemu_set_jit(emus[l], true))
+            fputs("JIT not available, interpreting\n", stderr);
+#endif
+        octemu_lanes_set_seed(ls, l, seed + l);
+    }
+
+    uint16_t keypad = 0;
+    size_t next_input = 0;
+    unsigned long frame = 0;
+    for (unsigned int running = count; running && frame < frames; frame++) {
+        while (next_input < input_count && inputs[next_input].frame <= frame)
+            keypad = inputs[next_input++].keypad;
+        for (unsigned int l = 0; l < count; l++)
+            keypads[l] = keypad;
+        octemu_lanes_run(ls, tickrate, keypads, stops);
+        octemu_lanes_tick(ls);
+        for (unsigned int l = 0; l < count; l++) {
+            if (stopped[l])
+                continue;
+            const OctEmuRunResult res = octemu_run(emus[l], tickrate, keypad);
+            octemu_tick(emus[l]);
+            octemu_lanes_get(ls, l, lane);
+            uint8_t expected[OCTEMU_STATE_MAX_SIZE], state[OCTEMU_STATE_MAX_SIZE];
+            const size_t size = octemu_save_state(emus[l], expected, sizeof(expected));
+            if (res.stop != stops[l] || res.cycles != octemu_lanes_cycles(ls, l) ||
+                octemu_save_state(lane, state, sizeof(state)) != size || memcmp(state, expected, size)) {
+                fprintf(stderr, "Lane %u diverged at frame %lu\n", l, frame);
+                goto out;
+            }
+            octemu_take_gfx_dirty(emus[l]);
+            octemu_lanes_take_gfx_dirty(ls, l);
+            if (res.stop >= OCTEMU_STOP_EXIT) {
+                stopped[l] = true;
+                running--;
+            }
+        }
+    }
+    fprintf(stderr, "%u lanes matched %lu frames\n", count, frame);
+    ret = 0;
+
+out:
+    if (ls)
+        octemu_lanes_free(ls);
+    for (unsigned int l = 0; emus && l < count; l++) {
+        if (emus[l])
+            octemu_free(emus[l]);
+    }
+    free(emus);
+    if (lane)
+        octemu_free(lane);
+    free(keypads);
+    free(stops);
+    free(stopped);
+    return ret;
+}
+#endif
+
+static int write_frame(const OctEmu *emu, FILE *out, const int format) {
+    uint8_t buf[OCTEMU_GFX_HEIGHT * OCTEMU_GFX_WIDTH];
+    size_t size = 0;
+    if (format == FORMAT_PGM)
+        fprintf(out, "P5\n%d %d\n255\n", OCTEMU_GFX_WIDTH, OCTEMU_GFX_HEIGHT);
+    else if (format == FORMAT_PBM)
+        fprintf(out, "P4\n%d %d\n", OCTEMU_GFX_WIDTH, OCTEMU_GFX_HEIGHT);
+    for (uint8_t y = 0; y < OCTEMU_GFX_HEIGHT; y++) {
+        uint64_t row[2];
+        octemu_get_row(emu, y, row);
+        if (format == FORMAT_PGM) {
+            for (int x = 0; x < OCTEMU_GFX_WIDTH; x++)
+                buf[size++] = row[x >> 6] >> (63 - (x & 63)) & 1 ? 255 : 0;
+        } else { // packed 1bpp, msb first, 1 is set (black in PBM)
+            for (int w = 0; w < 2; w++) {
+                for (int b = 56; b >= 0; b -= 8)
+                    buf[size++] = row[w] >> b & 0xFF;
+            }
+        }
+    }
+    return fwrite(buf, 1, size, out) != size;
+}
+
+static void print_usage(const char *argv0) {
+    printf("Usage: %s [option...] <rom_file>...\n\nOPTIONS\n", argv0);
+    puts("-m chip8|schip|octo\tmode (default octo)");
+    printf("-t <uint>\t\ttickrate (default %d in chip8 mode, %d in schip/octo mode)\n",
+           OCTEMU_TICKRATE_CHIP8, OCTEMU_TICKRATE_SCHIP);
+    puts("-n <uint>\t\tnumber of frames to run (default 600)");
+    puts("-i <file>\t\tinput script, \"<frame> <hex keypad>\" per line (- for stdin)");
+    puts("-f pbm|pgm|raw|hash\toutput format (default hash)");
+    puts("-l\t\t\twrite only the last frame");
+    puts("-o <file>\t\toutput file (default stdout)");
+    puts("-r <uint>\t\trandom seed (default 0)");
+    puts("-j <uint>\t\tthreads for multiple ROMs (default one per CPU), only with -f hash");
+#ifdef OCTEMU_JIT
+    puts("-J\t\t\tcompile basic blocks to native code");
+#endif
+    puts("-L <file>\t\tresume from a save state");
+    puts("-S <file>\t\twrite a save state after the last frame");
+    puts("-R <file>\t\trecord a movie (keypad and screen hash of every frame)");
+    puts("-P <file>\t\treplay a movie and check every frame, instead of -m/-t/-n/-r/-i");
+#ifndef OCTEMU_NO_LANES
+    puts("-k <uint>\t\tcheck <uint> lockstep lanes against single emulators, seeds from -r on");
+#endif
+    puts("-v\t\t\tprint version and exit\n");
+}
+
+int main(int argc, char *argv[]) {
+    int opt, tickrate = 0, format = FORMAT_HASH;
+    unsigned long frames = 600;
+    unsigned int seed = 0, threads = 0, lanes = 0;
+    bool last_only = false, jit = false;
+    const char *input_path = NULL, *output_path = NULL, *state_in = NULL, *state_out = NULL;
+    const char *record_path = NULL, *replay_path = NULL;
+    OctEmuMode mode = OCTEMU_MODE_OCTO;
+    while ((opt = getopt(argc, argv, "m:t:n:i:f:lo:r:j:JL:S:R:P:k:v?h")) != -1) {
+        switch (opt) {
+        case 'm':
+            if (!strcmp(optarg, "chip8"))
+                mode = OCTEMU_MODE_CHIP8;
+            else if (!strcmp(optarg, "schip"))
+                mode = OCTEMU_MODE_SCHIP;
+            else if (!strcmp(optarg, "octo"))
+                mode = OCTEMU_MODE_OCTO;
+            else {
+                fputs("Invalid mode\n", stderr);
+                print_usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 't':
+            tickrate = atoi(optarg);
+            if (tickrate < 1) {
+                fputs("Invalid tickrate\n", stderr);
+                print_usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'n':
+            frames = strtoul(optarg, NULL, 10);
+            break;
+        case 'i':
+            input_path = optarg;
+            break;
+        case 'f':
+            if (!strcmp(optarg, "pbm"))
+                format = FORMAT_PBM;
+            else if (!strcmp(optarg, "pgm"))
+                format = FORMAT_PGM;
+            else if (!strcmp(optarg, "raw"))
+                format = FORMAT_RAW;
+            else if (!strcmp(optarg, "hash"))
+                format = FORMAT_HASH;
+            else {
+                fputs("Invalid format\n", stderr);
+                print_usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'l':
+            last_only = true;
+            break;
+        case 'o':
+            output_path = optarg;
+            break;
+        case 'r':
+            seed = strtoul(optarg, NULL, 10);
+            break;
+        case 'j':
+            threads = strtoul(optarg, NULL, 10);
+            break;
+#ifdef OCTEMU_JIT
+        case 'J':
+            jit = true;
+            break;
+#endif
+        case 'L':
+            state_in = optarg;
+            break;
+        case 'S':
+            state_out = optarg;
+            break;
+        case 'R':
+            record_path = optarg;
+            break;
+        case 'P':
+            replay_path = optarg;
+            break;
+#ifndef OCTEMU_NO_LANES
+        case 'k':
+            lanes = strtoul(optarg, NULL, 10);
+            break;
+#endif
+        case 'v':
+            puts("octemu " OCTEMU_VERSION);
+            return 0;
+        case '?':
+        case 'h':
+            print_usage(argv[0]);
+            return 0;
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (!tickrate)
+        tickrate = (mode == OCTEMU_MODE_CHIP8) ? OCTEMU_TICKRATE_CHIP8 : OCTEMU_TICKRATE_SCHIP;
+
+    int ret = 1;
+    size_t input_count = 0, next_input = 0;
+    Input *inputs = NULL;
+    FILE *out = stdout;
+    OctEmuMovie *movie = NULL, *replay = NULL;
+    OctEmuMovieInfo info;
+    if (replay_path) { // the movie gives the settings
+        if (!(replay = octemu_movie_open(replay_path, &info)))
+            return 1;
+        mode = info.mode;
+        tickrate = info.tickrate;
+        seed = info.seed;
+    }
+    OctEmu *emu = octemu_new(mode);
+    if (!emu || (argc - optind == 1 && octemu_load_rom_file(emu, argv[optind])))
+        goto out;
+    if (input_path && !(inputs = load_inputs(input_path, &input_count)))
+        goto out;
+    if (output_path && !(out = fopen(output_path, "wb"))) {
+        perror("Failed to open output file");
+        out = stdout;
+        goto out;
+    }
+    octemu_set_seed(emu, seed);
+#ifdef OCTEMU_JIT
+    if (jit && octemu_set_jit(emu, true))
+        fputs("JIT not available, interpreting\n", stderr);
+#endif
+#ifdef OCTEMU_AOT
+    use_static_code(emu);
+#endif
+
+    if (argc - optind > 1) {
+        if (format != FORMAT_HASH || state_in || state_out || record_path || replay || lanes) {
+            fputs("Multiple ROMs are only supported with -f hash and without save states, movies or lanes\n",
+                  stderr);
+            goto out;
+        }
+        ret = run_batch(argv + optind, argc - optind, mode, tickrate, frames, threads, seed, jit,
+                        inputs, input_count, out);
+        goto out;
+    }
+
+#ifndef OCTEMU_NO_LANES
+    if (lanes) {
+        if (format != FORMAT_HASH || state_in || state_out || record_path || replay) {
+            fputs("Lanes are only checked with -f hash and without save states or movies\n", stderr);
+            goto out;
+        }
+        ret = check_lanes(emu, lanes, tickrate, frames, seed, jit, inputs, input_count);
+        goto out;
+    }
+#endif
+    if (replay && info.rom_hash != octemu_rom_hash(emu)) {
+        fputs("The movie was recorded with another ROM\n", stderr);
+        goto out;
+    }
+    if ((record_path || replay) && state_in) {
+        fputs("Movies start from reset and cannot be combined with -L\n", stderr);
+        goto out;
+    }
+    if (record_path && !(movie = octemu_movie_record(record_path, emu, tickrate)))
+        goto out;
+    if (state_in) {
+        size_t size;
+        uint8_t *state = read_file(state_in, OCTEMU_STATE_MAX_SIZE, &size);
+        const int err = !state || octemu_load_state(emu, state, size);
+        free(state);
+        if (err) {
+            fprintf(stderr, "Failed to load state %s\n", state_in);
+            goto out;
+        }
+    }
+
+    uint16_t keypad = 0;
+    unsigned long matched = 0;
+    for (unsigned long frame = 0; replay || frame < frames; frame++) {
+        uint64_t expected = 0;
+        if (replay) {
+            const int end = octemu_movie_next(replay, &keypad, &expected);
+            if (end < 0) // truncated or unreadable, not verified
+                goto out;
+            if (end)
+                break;
+        } else {
+            while (next_input < input_count && inputs[next_input].frame <= frame)
+                keypad = inputs[next_input++].keypad;
+        }
+        const OctEmuRunResult res = octemu_run(emu, tickrate, keypad);
+        if (res.stop == OCTEMU_STOP_ERROR)
+            goto out;
+        octemu_tick(emu);
+        octemu_take_gfx_dirty(emu); // a frame was shown, the CHIP-8 display wait ends
+        if (movie && octemu_movie_frame(movie, keypad, emu))
+            goto out;
+        if (replay && octemu_gfx_hash(emu) != expected) {
+            fprintf(stderr, "Replay diverged at frame %lu\n", frame);
+            goto out;
+        }
+        matched++;
+        if (format != FORMAT_HASH && !last_only && write_frame(emu, out, format))
+            goto out;
+        if (res.stop == OCTEMU_STOP_EXIT) {
+            fprintf(stderr, "Emulator halted at frame %lu\n", frame);
+            break;
+        }
+    }
+    if (replay)
+        fprintf(stderr, "Replay matched %lu frames\n", matched);
+    if (format == FORMAT_HASH)
+        fprintf(out, "%016llx\n", (unsigned long long)octemu_gfx_hash(emu));
+    else if (last_only && write_frame(emu, out, format))
+        goto out;
+    if (state_out) {
+        uint8_t state[OCTEMU_STATE_MAX_SIZE];
+        const size_t size = octemu_save_state(emu, state, sizeof(state));
+        FILE *f = fopen(state_out, "wb");
+        bool ok = f && fwrite(state, 1, size, f) == size;
+        if (f && fclose(f))
+            ok = false;
+        if (!ok) {
+            perror("Failed to write save state");
+            goto out;
+        }
+    }
+    ret = 0;
+
+out:
+    if (movie && octemu_movie_close(movie))
+        ret = 1;
+    if (replay)
+        octemu_movie_close(replay);
+    if (out != stdout)
+        fclose(out);
+    free(inputs);
+    if (emu)
+        octemu_free(emu);
+    return ret;
+}
@@ -0,0 +1,137 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "movie.h"
+
+/*
+ * Movie layout, integers little endian:
+ *   "OCTM", version, mode, 0 (u16), tickrate (u32), seed (u32), ROM hash (u64)
+ *   runs of frames with the same keypad: keypad (u16), frames - 1 (u8),
+ *   then octemu_gfx_hash() after each frame of the run (u64)
+ */
+#define MOVIE_VERSION 1
+#define MOVIE_HEADER_SIZE 24
+#define MOVIE_RUN_MAX 256
+
+struct OctEmuMovie {
+    FILE *f;
+    bool recording;
+    // current run: keypad, frames in it and frames already read back (replay)
+    uint16_t keypad, count, next;
+    uint64_t hashes[MOVIE_RUN_MAX]; // recording: hashes of the current run
+};
+
+static inline void put_le(uint8_t *p, const uint64_t val, const int bytes) {
+    for (int b = 0; b < bytes; b++)
+        p[b] = val >> b * 8;
+}
+
+static inline uint64_t get_le(const uint8_t *p, const int bytes) {
+    uint64_t val = 0;
+    for (int b = 0; b < bytes; b++)
+        val |= (uint64_t)p[b] << b * 8;
+    return val;
+}
+
+OctEmuMovie *octemu_movie_record(const char *path, const OctEmu *emu, const unsigned int tickrate) {
+    OctEmuMovie *m = calloc(1, sizeof(OctEmuMovie));
+    if (!m || !(m->f = fopen(path, "wb"))) {
+        perror("Failed to create movie");
+        free(m);
+        return NULL;
+    }
+    m->recording = true;
+    uint8_t header[MOVIE_HEADER_SIZE] = {'O', 'C', 'T', 'M', MOVIE_VERSION, emu->mode};
+    put_le(header + 8, tickrate, 4);
+    put_le(header + 12, emu->seed, 4);
+    put_le(header + 16, octemu_rom_hash(emu), 8);
+    if (fwrite(header, 1, sizeof(header), m->f) != sizeof(header)) {
+        perror("Failed to write movie");
+        fclose(m->f);
+        free(m);
+        return NULL;
+    }
+    return m;
+}
+
+static int flush_run(OctEmuMovie *m) {
+    uint8_t buf[3 + MOVIE_RUN_MAX * 8];
+    put_le(buf, m->keypad, 2);
+    buf[2] = m->count - 1;
+    for (uint16_t n = 0; n < m->count; n++)
+        put_le(buf + 3 + n * 8, m->hashes[n], 8);
+    const size_t size = 3 + m->count * 8;
+    m->count = 0;
+    return fwrite(buf, 1, size, m->f) != size;
+}
+
+int octemu_movie_frame(OctEmuMovie *m, const uint16_t keypad, const OctEmu *emu) {
+    if (m->count && (keypad != m->keypad || m->count == MOVIE_RUN_MAX) && flush_run(m)) {
+        perror("Failed to write movie");
+        return 1;
+    }
+    m->keypad = keypad;
+    m->hashes[m->count++] = octemu_gfx_hash(emu);
+    return 0;
+}
+
+OctEmuMovie *octemu_movie_open(const char *path, OctEmuMovieInfo *info) {
+    OctEmuMovie *m = calloc(1, sizeof(OctEmuMovie));
+    if (!m || !(m->f = fopen(path, "rb"))) {
+        perror("Failed to open movie");
+        free(m);
+        return NULL;
+    }
+    uint8_t header[MOVIE_HEADER_SIZE];
+    if (fread(header, 1, sizeof(header), m->f) != sizeof(header) || memcmp(header, "OCTM", 4) ||
+        header[4] != MOVIE_VERSION || header[5] > OCTEMU_MODE_OCTO) {
+        fputs("Unsupported movie file\n", stderr);
+        fclose(m->f);
+        free(m);
+        return NULL;
+    }
+    info->mode = header[5];
+    info->tickrate = get_le(header + 8, 4);
+    info->seed = get_le(header + 12, 4);
+    info->rom_hash = get_le(header + 16, 8);
+    return m;
+}
+
+int octemu_movie_next(OctEmuMovie *m, uint16_t *keypad, uint64_t *hash) {
+    uint8_t buf[8];
+    if (m->next == m->count) {
+        const size_t size = fread(buf, 1, 3, m->f);
+        if (!size && feof(m->f))
+            return 1; // a run ends exactly at the end of the file
+        if (size != 3)
+            goto err;
+        m->keypad = get_le(buf, 2);
+        m->count = buf[2] + 1;
+        m->next = 0;
+    }
+    if (fread(buf, 1, 8, m->f) != 8)
+        goto err;
+    m->next++;
+    *keypad = m->keypad;
+    *hash = get_le(buf, 8);
+    return 0;
+
+err:
+    if (ferror(m->f))
+        perror("Failed to read movie");
+    else
+        fputs("Truncated movie file\n", stderr);
+    return -1;
+}
+
+int octemu_movie_close(OctEmuMovie *m) {
+    int ret = m->recording && m->count && flush_run(m);
+    if (fclose(m->f))
+        ret = 1;
+    if (ret)
+        perror("Failed to write movie");
+    free(m);
+    return ret;
+}
@@ -0,0 +1,57 @@
+#ifndef _OCTEMU_MOVIE_H_
+#define _OCTEMU_MOVIE_H_
+
+#include <stdint.h>
+
+#include "core.h"
+
+/**
+ * Movie file (opaque): everything needed to replay a session frame by frame and
+ * check it. The header holds the ROM hash, mode, tickrate and seed. Frames are
+ * stored as runs of one keypad state, with the screen hash after each frame.
+ */
+typedef struct OctEmuMovie OctEmuMovie;
+
+typedef struct OctEmuMovieInfo {
+    OctEmuMode mode;
+    unsigned int tickrate;
+    uint32_t seed;
+    uint64_t rom_hash; // octemu_rom_hash()
+} OctEmuMovieInfo;
+
+/**
+ * Start recording to path. emu must be in reset state with the ROM, mode and seed
+ * of the session.
+ * @return NULL on failure
+ */
+OctEmuMovie *octemu_movie_record(const char *path, const OctEmu *emu, const unsigned int tickrate);
+
+/**
+ * Record one frame, after octemu_run() and octemu_tick().
+ * @param keypad Keypad state the frame ran with
+ * @return 0 on success, 1 on write error
+ */
+int octemu_movie_frame(OctEmuMovie *, const uint16_t keypad, const OctEmu *emu);
+
+/**
+ * Open a movie for replay.
+ * @param info Receives the session settings
+ * @return NULL if the file cannot be read or is not a movie
+ */
+OctEmuMovie *octemu_movie_open(const char *path, OctEmuMovieInfo *info);
+
+/**
+ * Read the next frame of a replay.
+ * @param keypad Receives the keypad state to run the frame with
+ * @param hash Receives the expected octemu_gfx_hash() after the frame
+ * @return 0 on success, 1 at the end of the movie, -1 if it is truncated or cannot be read
+ */
+int octemu_movie_next(OctEmuMovie *, uint16_t *keypad, uint64_t *hash);
+
+/**
+ * Finish recording (writes pending frames) or replay and free the movie.
+ * @return 0 on success, 1 on write error
+ */
+int octemu_movie_close(OctEmuMovie *);
+
+#endif // _OCTEMU_MOVIE_H_
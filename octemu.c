@@ -12,7 +12,9 @@
 #include "SDL3/SDL_main.h"
 
 #include "core.h"
+#include "movie.h"
 #include "octemu.h"
+#include "rewind.h"
 
 #define EXITING 0
 #define RUNNING 1
@@ -30,61 +32,173 @@ static SDL_Renderer *renderer = NULL;
 static SDL_Texture *texture = NULL;
 static SDL_AudioStream *audio_stream = NULL;
 static OctEmu *emu_core = NULL;
+static OctEmuRewind *rewind_buf = NULL; // owned by eval_loop, NULL if disabled
+static OctEmuMovie *movie = NULL; // owned by eval_loop, NULL if not recording
 static SDL_Thread *eval_thread = NULL;
 
 static atomic_uchar status = RUNNING;
 static atomic_ushort keypad = 0; // 0: none, 0-15 bit: keypad[0-15]
-static atomic_bool sound = false, gfx_reload = true;
-static SDL_Mutex *gfx_lock = NULL;
-static uint8_t gfx_buffer[OCTEMU_GFX_HEIGHT][OCTEMU_GFX_WIDTH / 8];
+static atomic_bool sound = false;
+static atomic_bool rewinding = false; // rewind key held
+
+/**
+ * Triple buffered frames: eval_loop owns frames[frame_back], SDL_AppIterate owns
+ * frames[frame_front] and the third one is handed over by swapping it with frame_mid.
+ * FRAME_FRESH in frame_mid marks a frame published but not picked up yet.
+ */
+#define FRAME_FRESH 4
+static uint64_t frames[3][OCTEMU_GFX_HEIGHT][OCTEMU_GFX_WIDTH / 64];
+static uint8_t frame_back = 0, frame_front = 2;
+static atomic_uchar frame_mid = 1 | FRAME_FRESH;
+static atomic_uint_least64_t frame_dirty = OCTEMU_GFX_DIRTY_ALL; // rows changed since last upload
+
+// called by eval_loop after frames[frame_back] is filled
+static void publish_frame(const uint64_t dirty) {
+    frame_back = atomic_exchange_explicit(&frame_mid, frame_back | FRAME_FRESH, memory_order_acq_rel) & 3;
+    atomic_fetch_or_explicit(&frame_dirty, dirty, memory_order_release);
+}
 
 static bool screenshot = false; // not shared
 
-static int eval_loop(void *tickrate) {
+static int tickrate = 0, max_catchup = OCTEMU_MAX_CATCHUP; // set before eval_thread starts
+static int rewind_kib = OCTEMU_REWIND_KIB;
+static double speed = 1.0; // virtual frames per 1/60 s, 0: uncapped
+static atomic_bool turbo = false; // uncapped regardless of speed
+static atomic_uint fps = 0; // achieved virtual frames per second * 100
+
+static int eval_loop(void *_) {
     // assert(emu_core);
-    srand((unsigned int)time(NULL));
+    bool resync = true;
+    uint64_t epoch = 0, frame = 0; // deadline of virtual frame n is epoch + n * frame_ns
+    const double frame_ns = speed ? SDL_NS_PER_SECOND / (60 * speed) : 0;
+    uint64_t fps_start = 0, publish_time = 0;
+    unsigned int fps_frames = 0;
+    uint64_t pending = 0; // dirty rows not published yet
+
+    if (rewind_buf)
+        octemu_rewind_clear(rewind_buf, emu_core);
     for (uint8_t s = PAUSED; s; s = load(status)) {
-        if (s == PAUSED || s == HALTED) {
+        // a movie replays from reset with every frame, stop recording when that no longer holds
+        if (movie && (s == RESET || (rewind_buf && load(rewinding)))) {
+            octemu_movie_close(movie);
+            movie = NULL;
+            fputs("Recording stopped\n", stderr);
+        }
+        if (s == HALTED && rewind_buf && load(rewinding)) {
+            store(status, RUNNING); // rewind out of a halt
+        } else if (s == PAUSED || s == HALTED) {
             usleep(200000);
+            resync = true;
             continue;
         } else if (s == RESET) {
             octemu_reset(emu_core);
-            SDL_LockMutex(gfx_lock);
-            memset(gfx_buffer, 0, sizeof(gfx_buffer));
-            store(gfx_reload, true);
-            SDL_UnlockMutex(gfx_lock);
+            if (rewind_buf)
+                octemu_rewind_clear(rewind_buf, emu_core);
+            memset(frames[frame_back], 0, sizeof(frames[frame_back]));
+            publish_frame(OCTEMU_GFX_DIRTY_ALL);
+            pending = 0;
             store(status, RUNNING);
             continue;
         }
-
-        int err = 0;
-        const uint16_t current_keypad = atomic_load(&keypad);
-        for (int i = 0; i < *(int *)tickrate; i++) {
-            err = octemu_eval(emu_core, current_keypad);
-            if (err || (emu_core->mode == OCTEMU_MODE_CHIP8 && emu_core->gfx_dirty))
-                break;
+        if (resync) {
+            epoch = fps_start = SDL_GetTicksNS();
+            frame = fps_frames = 0;
+            resync = false;
         }
 
-        if (err) {
+        // while the rewind key is held, step back one snapshot per virtual frame
+        const bool back = rewind_buf && load(rewinding);
+        if (back) {
+            if (!octemu_rewind_pop(rewind_buf, emu_core))
+                pending = OCTEMU_GFX_DIRTY_ALL;
             store(sound, 0);
-            fputs("Emulator halted...\n", stderr);
-            store(status, HALTED);
-            continue;
-        } else if (emu_core->gfx_dirty) {
-            SDL_LockMutex(gfx_lock);
-            memcpy(gfx_buffer, emu_core->gfx, sizeof(gfx_buffer));
-            store(gfx_reload, true);
-            SDL_UnlockMutex(gfx_lock);
-            emu_core->gfx_dirty = false;
+        } else {
+            const uint16_t kp = atomic_load(&keypad);
+            const OctEmuRunResult res = octemu_run(emu_core, tickrate, kp);
+            if (res.stop >= OCTEMU_STOP_EXIT) {
+                store(sound, 0);
+                fputs("Emulator halted...\n", stderr);
+                store(status, HALTED);
+                continue;
+            }
+            pending |= octemu_take_gfx_dirty(emu_core);
+            store(sound, emu_core->sound != 0);
+            octemu_tick(emu_core);
+            if (movie && octemu_movie_frame(movie, kp, emu_core)) {
+                octemu_movie_close(movie);
+                movie = NULL;
+            }
+            if (rewind_buf)
+                octemu_rewind_push(rewind_buf, emu_core);
         }
-        store(sound, emu_core->sound != 0);
 
-        usleep(16666);
-        octemu_tick(emu_core);
+        // timers always advance once per virtual frame, only the wall time of a frame varies
+        uint64_t now = SDL_GetTicksNS();
+        const bool uncapped = !frame_ns || load(turbo);
+        // no more than one frame per display refresh is copied out when running fast
+        if (pending && ((!uncapped && frame_ns >= SDL_NS_PER_SECOND / 60) || now - publish_time >= SDL_NS_PER_SECOND / 60)) {
+            for (int y = 0; y < OCTEMU_GFX_HEIGHT; y++)
+                octemu_get_row(emu_core, y, frames[frame_back][y]);
+            publish_frame(pending);
+            pending = 0;
+            publish_time = now;
+        }
+
+        if (uncapped) {
+            // keep the deadline chain fresh for when turbo is switched off
+            epoch = now;
+            frame = 0;
+        } else {
+            // sleep to an absolute deadline so execution time does not add up to drift.
+            // when late, run the next frames back to back to catch up, unless more than
+            // max_catchup frames behind, then drop them and restart from now.
+            const uint64_t deadline = epoch + (uint64_t)(++frame * frame_ns);
+            if (now < deadline) {
+                SDL_DelayPrecise(deadline - now);
+                now = SDL_GetTicksNS();
+            } else if (now - deadline > (uint64_t)(max_catchup * frame_ns)) {
+                epoch = now;
+                frame = 0;
+            }
+        }
+        fps_frames++;
+        if (now - fps_start >= SDL_NS_PER_SECOND) {
+            store(fps, (unsigned int)(fps_frames * 100 * SDL_NS_PER_SECOND / (now - fps_start)));
+            fps_start = now;
+            fps_frames = 0;
+        }
     }
     return 0;
 }
 
+// convert and upload dirty rows, one texture lock per run of consecutive rows
+static bool update_texture(const uint64_t buffer[][OCTEMU_GFX_WIDTH / 64], const uint64_t dirty) {
+    for (int y = 0; y < OCTEMU_GFX_HEIGHT;) {
+        if (!(dirty >> y & 1)) {
+            y++;
+            continue;
+        }
+        int end = y + 1;
+        while (end < OCTEMU_GFX_HEIGHT && dirty >> end & 1)
+            end++;
+        const SDL_Rect rect = {0, y, OCTEMU_GFX_WIDTH, end - y};
+        uint32_t *pixels;
+        int pitch;
+        if (!SDL_LockTexture(texture, &rect, (void **)&pixels, &pitch))
+            return false;
+        for (; y < end; y++, pixels += pitch / sizeof(uint32_t)) {
+            for (int x = 0; x < OCTEMU_GFX_WIDTH; x++) {
+                if (buffer[y][x >> 6] >> (63 - (x & 63)) & 1)
+                    pixels[x] = (OCTEMU_FOREGROUND_RGB & 0xFFFFFF) | 0xFF000000;
+                else
+                    pixels[x] = (OCTEMU_BACKGROUND_RGB & 0xFFFFFF) | 0xFF000000;
+            }
+        }
+        SDL_UnlockTexture(texture);
+    }
+    return true;
+}
+
 static int printscreen() {
     SDL_Surface *surface = SDL_RenderReadPixels(renderer, NULL);
     if (!surface) {
@@ -103,19 +217,36 @@ static int printscreen() {
     return 0;
 }
 
+static void update_title() {
+    char title[64];
+    const unsigned int f = load(fps);
+    if (load(status) == PAUSED)
+        SDL_snprintf(title, sizeof(title), "octemu %s (paused)", OCTEMU_VERSION);
+    else if (f)
+        SDL_snprintf(title, sizeof(title), "octemu %s (%u.%02u fps, %u.%02ux%s)", OCTEMU_VERSION,
+                     f / 100, f % 100, f / 6000, f / 60 % 100, load(turbo) ? ", turbo" : "");
+    else
+        SDL_snprintf(title, sizeof(title), "octemu %s", OCTEMU_VERSION);
+    SDL_SetWindowTitle(window, title);
+}
+
 static void print_usage(const char *argv0) {
     printf("Usage: %s [option...] <rom_file>\n\nOPTIONS\n", argv0);
     puts("-m chip8|schip|octo\tmode (default octo)");
     printf("-t <uint>\t\ttickrate (default %d in chip8 mode, %d in schip/octo mode)\n",
            OCTEMU_TICKRATE_CHIP8, OCTEMU_TICKRATE_SCHIP);
+    puts("-s <float>\t\tspeed multiplier, 0 for uncapped (default 1)");
+    printf("-c <uint>\t\tmax frames to catch up after a stall (default %d)\n", OCTEMU_MAX_CATCHUP);
+    printf("-r <uint>\t\trewind buffer in KiB, 0 to disable (default %d)\n", OCTEMU_REWIND_KIB);
+    puts("-R <file>\t\trecord input to a movie for octemu-headless -P");
     puts("-v\t\t\tprint version and exit\n");
 }
 
 SDL_AppResult SDL_AppInit(void **appstate, int argc, char *argv[]) {
     int opt;
-    static int tickrate = 0;
     OctEmuMode mode = OCTEMU_MODE_OCTO;
-    while ((opt = getopt(argc, argv, "t:m:v?h")) != -1) {
+    const char *movie_file = NULL;
+    while ((opt = getopt(argc, argv, "t:m:s:c:r:R:v?h")) != -1) {
         switch (opt) {
         case 't':
             tickrate = atoi(optarg);
@@ -125,6 +256,35 @@ SDL_AppResult SDL_AppInit(void **appstate, int argc, char *argv[]) {
                 return SDL_APP_FAILURE;
             }
             break;
+        case 's': {
+            char *end;
+            speed = strtod(optarg, &end);
+            if (end == optarg || *end || speed < 0 || speed > 1000 || (speed && speed < 0.01)) {
+                fputs("Invalid speed\n", stderr);
+                print_usage(argv[0]);
+                return SDL_APP_FAILURE;
+            }
+            break;
+        }
+        case 'c':
+            max_catchup = atoi(optarg);
+            if (max_catchup < 0 || max_catchup > 60) {
+                fputs("Invalid catch-up limit\n", stderr);
+                print_usage(argv[0]);
+                return SDL_APP_FAILURE;
+            }
+            break;
+        case 'r':
+            rewind_kib = atoi(optarg);
+            if (rewind_kib < 0 || rewind_kib > 1024 * 1024) {
+                fputs("Invalid rewind buffer size\n", stderr);
+                print_usage(argv[0]);
+                return SDL_APP_FAILURE;
+            }
+            break;
+        case 'R':
+            movie_file = optarg;
+            break;
         case 'm':
             if (!strcmp(optarg, "chip8"))
                 mode = OCTEMU_MODE_CHIP8;
@@ -159,6 +319,11 @@ SDL_AppResult SDL_AppInit(void **appstate, int argc, char *argv[]) {
     emu_core = octemu_new(mode);
     if (!emu_core || octemu_load_rom_file(emu_core, argv[optind]))
         return SDL_APP_FAILURE;
+    octemu_set_seed(emu_core, (uint32_t)time(NULL));
+    if (rewind_kib && !(rewind_buf = octemu_rewind_new((size_t)rewind_kib * 1024)))
+        return SDL_APP_FAILURE;
+    if (movie_file && !(movie = octemu_movie_record(movie_file, emu_core, tickrate)))
+        return SDL_APP_FAILURE;
 
     SDL_SetAppMetadata("octemu", OCTEMU_VERSION, NULL);
     if (!SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO) ||
@@ -186,10 +351,7 @@ SDL_AppResult SDL_AppInit(void **appstate, int argc, char *argv[]) {
         audio_samples[i * 2 + 1] = 64;
     }
 
-    gfx_lock = SDL_CreateMutex();
-    if (!gfx_lock)
-        goto err;
-    eval_thread = SDL_CreateThread(eval_loop, "eval_loop", &tickrate);
+    eval_thread = SDL_CreateThread(eval_loop, "eval_loop", NULL);
     if (!eval_thread)
         goto err;
 
@@ -201,7 +363,12 @@ err:
 }
 
 SDL_AppResult SDL_AppIterate(void *appstate) {
-    static uint8_t local_buffer[OCTEMU_GFX_HEIGHT][OCTEMU_GFX_WIDTH / 8];
+    static uint64_t title_time = 0;
+    const uint64_t now = SDL_GetTicksNS();
+    if (now - title_time >= SDL_NS_PER_SECOND) {
+        update_title();
+        title_time = now;
+    }
 
     if (load(status) == RUNNING && load(sound)) {
         if (SDL_GetAudioStreamQueued(audio_stream) < 50 * sizeof(uint8_t))
@@ -209,29 +376,12 @@ SDL_AppResult SDL_AppIterate(void *appstate) {
     } else if (SDL_GetAudioStreamQueued(audio_stream))
         SDL_ClearAudioStream(audio_stream);
 
-    if (load(gfx_reload)) {
-        SDL_LockMutex(gfx_lock);
-        memcpy(local_buffer, gfx_buffer, sizeof(local_buffer));
-        store(gfx_reload, false);
-        SDL_UnlockMutex(gfx_lock);
-
-        uint32_t *pixels;
-        int pitch;
-        if (!SDL_LockTexture(texture, NULL, (void **)&pixels, &pitch))
-            return SDL_APP_FAILURE;
-        for (int y = 0; y < OCTEMU_GFX_HEIGHT; y++) {
-            for (int x = 0; x < (OCTEMU_GFX_WIDTH >> 3); x++) {
-                for (int bit = 0; bit < 8; bit++) {
-                    const uint16_t pos = y * OCTEMU_GFX_WIDTH + x * 8 + bit;
-                    if (local_buffer[y][x] & (1 << (7 - bit)))
-                        pixels[pos] = (OCTEMU_FOREGROUND_RGB & 0xFFFFFF) | 0xFF000000;
-                    else
-                        pixels[pos] = (OCTEMU_BACKGROUND_RGB & 0xFFFFFF) | 0xFF000000;
-                }
-            }
-        }
-        SDL_UnlockTexture(texture);
-    }
+    // take dirty rows before the frame, so rows published later are uploaded next time
+    const uint64_t dirty = atomic_exchange_explicit(&frame_dirty, 0, memory_order_acq_rel);
+    if (load(frame_mid) & FRAME_FRESH)
+        frame_front = atomic_exchange_explicit(&frame_mid, frame_front, memory_order_acq_rel) & 3;
+    if (dirty && !update_texture(frames[frame_front], dirty))
+        return SDL_APP_FAILURE;
     SDL_RenderTexture(renderer, texture, NULL, NULL);
     if (screenshot) {
         printscreen();
@@ -245,6 +395,8 @@ SDL_AppResult SDL_AppEvent(void *appstate, SDL_Event *event) {
     if (event->type == SDL_EVENT_QUIT)
         return SDL_APP_SUCCESS;
     else if (event->type == SDL_EVENT_KEY_DOWN) {
+        if (event->key.scancode == SDL_SCANCODE_BACKSPACE) // rewind while held
+            store(rewinding, true);
         for (int i = 0; i < 16; i++) {
             if (event->key.scancode == keymapping[i]) {
                 atomic_fetch_or_explicit(&keypad, 1 << OctEmu_Keypad[i], memory_order_acq_rel);
@@ -257,23 +409,27 @@ SDL_AppResult SDL_AppEvent(void *appstate, SDL_Event *event) {
             return SDL_APP_SUCCESS;
         case SDL_SCANCODE_SPACE: { // pause/resume
             const uint8_t current_status = load(status);
-            if (current_status == RUNNING) {
+            if (current_status == RUNNING)
                 store(status, PAUSED);
-                SDL_SetWindowTitle(window, "octemu " OCTEMU_VERSION " (paused)");
-            } else if (current_status == PAUSED) {
+            else if (current_status == PAUSED)
                 store(status, RUNNING);
-                SDL_SetWindowTitle(window, "octemu " OCTEMU_VERSION);
-            }
+            update_title();
             break;
         }
         case SDL_SCANCODE_F5: // reset
-            if (load(status) == PAUSED)
-                SDL_SetWindowTitle(window, "octemu " OCTEMU_VERSION);
             store(status, RESET);
+            update_title();
+            break;
+        case SDL_SCANCODE_TAB: // turbo on/off
+            store(turbo, !load(turbo));
+            update_title();
             break;
         case SDL_SCANCODE_F12: // screenshot
             screenshot = true;
             break;
+        case SDL_SCANCODE_BACKSPACE:
+            store(rewinding, false);
+            break;
         default:
             for (int i = 0; i < 16; i++) {
                 if (event->key.scancode == keymapping[i]) {
@@ -293,8 +449,10 @@ void SDL_AppQuit(void *appstate, SDL_AppResult result) {
         store(status, EXITING);
         SDL_WaitThread(eval_thread, NULL);
     }
-    if (gfx_lock)
-        SDL_DestroyMutex(gfx_lock);
     if (emu_core)
         octemu_free(emu_core);
+    if (rewind_buf)
+        octemu_rewind_free(rewind_buf);
+    if (movie)
+        octemu_movie_close(movie);
 }
@@ -9,6 +9,12 @@
 #ifndef OCTEMU_TICKRATE_SCHIP
 #define OCTEMU_TICKRATE_SCHIP 200
 #endif
+#ifndef OCTEMU_MAX_CATCHUP
+#define OCTEMU_MAX_CATCHUP 3
+#endif
+#ifndef OCTEMU_REWIND_KIB
+#define OCTEMU_REWIND_KIB 4096
+#endif
 #ifndef OCTEMU_FOREGROUND_RGB
 #define OCTEMU_FOREGROUND_RGB 0x2AA198
 #endif
@@ -30,6 +30,8 @@ extern const OctEmuRom emu_roms[];
 extern const uint emu_roms_count; 
 
 static sh1106 *display = NULL;
+// set up by octemu_init(), so the core never allocates the predecoded instruction cache
+static OctEmu emu_storage;
 
 static inline void start_sound() {
 #ifdef OCTEMU_PICO_ACTIVE_BUZZER
@@ -77,13 +79,18 @@ static uint16_t read_keypad() {
 }
 
 // :(
-static void convert_vram(const OctEmu *emu, sh1106 *display) {
+static void convert_vram(const OctEmu *emu, sh1106 *display, const uint64_t rows_dirty) {
     for (uint page = 0; page < 8; page++) {
+        if (!(rows_dirty >> (page * 8) & 0xFF))
+            continue;
         uint8_t dirty = 0;
+        uint64_t rows[8][2];
+        for (uint bit = 0; bit < 8; bit++)
+            octemu_get_row(emu, page * 8 + bit, rows[bit]);
         for (uint col = 0; col < 128; col++) {
             uint8_t byte = 0;
             for (uint bit = 0; bit < 8; bit++) {
-                const uint8_t pixel = (emu->gfx[page * 8 + bit][col / 8] >> (7 - (col % 8))) & 1;
+                const uint8_t pixel = (rows[bit][col / 64] >> (63 - (col % 64))) & 1;
                 byte |= pixel << bit;
             }
             if (display->vram[page][col] != byte) {
@@ -173,15 +180,8 @@ static void emu_loop(OctEmu *emu, const unsigned int tickrate) {
             continue;
         }
 
-        int err = 0;
-        const uint16_t keypad = read_keypad();
-        for (uint i = 0; i < tickrate; i++) {
-            err = octemu_eval(emu, keypad);
-            if (err || (emu->mode == OCTEMU_MODE_CHIP8 && emu->gfx_dirty))
-                break;
-        }
-
-        if (err) {
+        const OctEmuRunResult res = octemu_run(emu, tickrate, read_keypad());
+        if (res.stop >= OCTEMU_STOP_EXIT) {
             if (sound){
                 stop_sound();
                 sound = false;
@@ -202,9 +202,8 @@ static void emu_loop(OctEmu *emu, const unsigned int tickrate) {
         }
 
         if (emu->gfx_dirty) {
-            convert_vram(emu, display);
+            convert_vram(emu, display, octemu_take_gfx_dirty(emu));
             sh1106_write(display);
-            emu->gfx_dirty = false;
         }
 
         const uint64_t now = to_us_since_boot(get_absolute_time());
@@ -268,8 +267,10 @@ int main() {
 #endif
 
     // emulator core
-    OctEmu *emu = octemu_new(OCTEMU_MODE_OCTO);
-    srand(get_rand_32());
+    OctEmu *emu = &emu_storage;
+    if (octemu_init(emu, str2mode(emu_roms[0].mode)))
+        goto err;
+    octemu_set_seed(emu, get_rand_32());
 
     // ready
     gpio_put(25, true);
@@ -279,9 +280,12 @@ int main() {
         // select rom
         const OctEmuRom *emu_rom = emu_roms_count > 1 ? menu(&menu_pos) : &emu_roms[0];
         // load rom
-        if (octemu_set_rom(emu, emu_rom->data, emu_rom->length))
+        if (octemu_set_mode(emu, str2mode(emu_rom->mode)) ||
+            octemu_set_rom(emu, emu_rom->data, emu_rom->length))
             break;
-        emu->mode = str2mode(emu_rom->mode);
+#ifdef OCTEMU_AOT
+        octemu_set_static_code(emu, emu_rom->code);
+#endif
         sh1106_clear(display);
 #ifdef OCTEMU_DEBUG
         printf("Loaded ROM \"%s\": %d bytes, mode %d\n", emu_rom->title, emu->rom_size, emu->mode);
@@ -293,7 +297,7 @@ int main() {
     }
 
     // cleanup
-    octemu_free(emu);
+    octemu_deinit(emu);
     sh1106_shutdown(display);
     free(display);
 err:
@@ -19,7 +19,7 @@ def load_yml(file: str) -> list:
                 "title": _escape(rom["title"]),
                 "mode": rom.get("mode", "octo"),
                 "tickrate": int(rom.get("tickrate", 100)),
-                "data": bin2carray(rom["file"]),
+                "data": bin2carray(rom["file"]), "file": rom["file"],
             } for rom in yaml.safe_load(f).values()
         ]
 
@@ -41,17 +41,33 @@ def load_chip8archive() -> list:
             "title": _escape(info["title"]), "mode": mode,
             "tickrate": int(info["options"]["tickrate"]),
             "data": bin2carray(f"../chip8Archive/roms/{name}.ch8"),
+            "file": f"../chip8Archive/roms/{name}.ch8",
         })
     return roms
 
+def recompile(roms: list):
+    """Add the static code of each ROM (--aot, see aot/octemu_aot.py)"""
+    import os, sys
+    sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "aot"))
+    import octemu_aot
+    for n, rom in enumerate(roms):
+        with open(rom["file"], "rb") as f:
+            mode = rom["mode"] if rom["mode"] in octemu_aot.MODES else "octo"
+            rom["code"] = octemu_aot.recompile(f.read(), mode, f"rom{n}_code")
+
 if __name__ == "__main__":
     import sys
 
+    aot = "--aot" in sys.argv
+    args = [arg for arg in sys.argv[1:] if arg != "--aot"]
+
     with open("rom.c.jinja", "r") as f:
         tmpl = jinja2.Environment(autoescape=False).from_string(f.read())
 
-    roms = load_yml(sys.argv[2]) if len(sys.argv) > 2 else load_chip8archive()
+    roms = load_yml(args[1]) if len(args) > 1 else load_chip8archive()
     assert len(roms) > 0, "No ROMs"
+    if aot:
+        recompile(roms)
 
-    with open(sys.argv[1].removesuffix(".c") + ".c", "w") as f:
-        f.write(tmpl.render(roms=roms))
+    with open(args[0].removesuffix(".c") + ".c", "w") as f:
+        f.write(tmpl.render(roms=roms, aot=aot))
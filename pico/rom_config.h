@@ -1,7 +1,14 @@
+#ifdef OCTEMU_AOT
+#include "../core.h"
+#endif
+
 typedef struct OctEmuRom {
     const char *title;
     const char *mode;
     const unsigned int tickrate;
     const unsigned char *data;
     const unsigned int length;
+#ifdef OCTEMU_AOT
+    const OctEmuStaticCode *code; // render_romc.py --aot
+#endif
 } OctEmuRom;
@@ -0,0 +1,213 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rewind.h"
+
+#define REWIND_GFX_SIZE sizeof(((OctEmu *)0)->gfx)
+#define REWIND_SPAN_SIZE (OCTEMU_MEM_SIZE + REWIND_GFX_SIZE)
+#define REWIND_MIN_RUN 4 // unchanged bytes that end a literal, shorter gaps cost less than a record
+// worst case of encode_span() on memory and screen: a 4 byte record per 5 bytes
+#define REWIND_DELTA_MAX (REWIND_SPAN_SIZE * 2)
+
+// everything but memory and screen, stored in full in every snapshot
+typedef struct RewindRegs {
+    uint16_t pc, i, keypad;
+    uint16_t stack[OCTEMU_STACK_SIZE];
+    uint8_t v[0x10], sp, delay, sound, hires;
+    uint8_t rpl[0x10];
+    uint32_t rng;
+    uint64_t gfx_dirty;
+} RewindRegs;
+
+/**
+ * Snapshot records are stored back to back in a byte ring, wrapping around the end:
+ * size (u32), RewindRegs, delta, size (u32). The trailing size lets pop() find
+ * the start of the newest record, the leading one lets push() drop the oldest.
+ */
+struct OctEmuRewind {
+    uint8_t *ring;
+    size_t capacity;
+    size_t head, tail; // positions of the next record and the oldest one, head - tail bytes used
+    size_t frames;
+    // state at the newest snapshot (memory, screen and registers)
+    uint8_t shadow[REWIND_SPAN_SIZE];
+    RewindRegs regs;
+    uint8_t delta[REWIND_DELTA_MAX]; // scratch for encoding
+    uint8_t mem[OCTEMU_MEM_SIZE];    // scratch for the memory of emu
+};
+
+OctEmuRewind *octemu_rewind_new(const size_t budget) {
+    OctEmuRewind *r = calloc(1, sizeof(OctEmuRewind));
+    if (r)
+        r->ring = malloc(budget);
+    if (!r || !r->ring) {
+        fputs("Failed to create OctEmuRewind\n", stderr);
+        free(r);
+        return NULL;
+    }
+    r->capacity = budget;
+    return r;
+}
+
+void octemu_rewind_free(OctEmuRewind *r) {
+    free(r->ring);
+    free(r);
+}
+
+static void get_regs(const OctEmu *emu, RewindRegs *regs) {
+    regs->pc = emu->pc;
+    regs->i = emu->i;
+    regs->keypad = emu->keypad;
+    memcpy(regs->stack, emu->stack, sizeof(regs->stack));
+    memcpy(regs->v, emu->v, sizeof(regs->v));
+    regs->sp = emu->sp;
+    regs->delay = emu->delay;
+    regs->sound = emu->sound;
+    regs->hires = emu->hires;
+    memcpy(regs->rpl, emu->rpl, sizeof(regs->rpl));
+    regs->rng = emu->rng;
+    regs->gfx_dirty = emu->gfx_dirty;
+}
+
+static void set_regs(OctEmu *emu, const RewindRegs *regs) {
+    emu->pc = regs->pc;
+    emu->i = regs->i;
+    emu->keypad = regs->keypad;
+    memcpy(emu->stack, regs->stack, sizeof(emu->stack));
+    memcpy(emu->v, regs->v, sizeof(emu->v));
+    emu->sp = regs->sp;
+    emu->delay = regs->delay;
+    emu->sound = regs->sound;
+    emu->hires = regs->hires;
+    memcpy(emu->rpl, regs->rpl, sizeof(emu->rpl));
+    emu->rng = regs->rng;
+    emu->gfx_dirty = regs->gfx_dirty;
+}
+
+void octemu_rewind_clear(OctEmuRewind *r, const OctEmu *emu) {
+    r->head = r->tail = r->frames = 0;
+    octemu_read_mem(emu, 0, r->shadow, OCTEMU_MEM_SIZE);
+    memcpy(r->shadow + OCTEMU_MEM_SIZE, &emu->gfx, REWIND_GFX_SIZE);
+    get_regs(emu, &r->regs);
+}
+
+static void ring_write(OctEmuRewind *r, const size_t pos, const void *src, const size_t n) {
+    const size_t at = pos % r->capacity, first = n < r->capacity - at ? n : r->capacity - at;
+    memcpy(r->ring + at, src, first);
+    memcpy(r->ring, (const uint8_t *)src + first, n - first);
+}
+
+static void ring_read(const OctEmuRewind *r, const size_t pos, void *dst, const size_t n) {
+    const size_t at = pos % r->capacity, first = n < r->capacity - at ? n : r->capacity - at;
+    memcpy(dst, r->ring + at, first);
+    memcpy((uint8_t *)dst + first, r->ring, n - first);
+}
+
+static inline void put_u16(uint8_t *p, const uint16_t val) {
+    p[0] = val & 0xFF;
+    p[1] = val >> 8;
+}
+
+static inline uint16_t get_u16(const uint8_t *p) { return p[0] | p[1] << 8; }
+
+/**
+ * Encode the XOR of prev and cur (n bytes) as records of skip (u16), count (u16)
+ * and count XORed bytes, ended by a record with count 0. Copies cur into prev.
+ * @return Bytes written to out
+ */
+static size_t encode_span(uint8_t *out, uint8_t *prev, const uint8_t *cur, const size_t n) {
+    size_t len = 0;
+    for (size_t pos = 0;;) {
+        const size_t start = pos;
+        while (pos < n) {
+            if (!(pos & 7) && pos + 8 <= n && !memcmp(prev + pos, cur + pos, 8))
+                pos += 8; // most of memory does not change between frames
+            else if (prev[pos] == cur[pos])
+                pos++;
+            else
+                break;
+        }
+        size_t end = pos; // past the last changed byte of the literal
+        if (pos < n) {
+            end = pos + 1;
+            for (size_t a = end; a < n && a - end < REWIND_MIN_RUN; a++) {
+                if (prev[a] != cur[a])
+                    end = a + 1;
+            }
+        }
+        put_u16(out + len, pos - start);
+        put_u16(out + len + 2, end - pos);
+        len += 4;
+        if (pos == end)
+            return len;
+        for (; pos < end; pos++) {
+            out[len++] = prev[pos] ^ cur[pos];
+            prev[pos] = cur[pos];
+        }
+    }
+}
+
+// XOR a span written by encode_span() into dst, returns the end of the span
+static const uint8_t *decode_span(const uint8_t *in, uint8_t *dst) {
+    for (size_t pos = 0;;) {
+        pos += get_u16(in);
+        const uint16_t count = get_u16(in + 2);
+        in += 4;
+        if (!count)
+            return in;
+        for (uint16_t c = 0; c < count; c++)
+            dst[pos++] ^= *in++;
+    }
+}
+
+void octemu_rewind_push(OctEmuRewind *r, const OctEmu *emu) {
+    octemu_read_mem(emu, 0, r->mem, OCTEMU_MEM_SIZE);
+    size_t len = encode_span(r->delta, r->shadow, r->mem, OCTEMU_MEM_SIZE);
+    len += encode_span(r->delta + len, r->shadow + OCTEMU_MEM_SIZE, (const uint8_t *)&emu->gfx,
+                       REWIND_GFX_SIZE);
+    // the record leads from this frame back to the previous snapshot
+    const uint32_t size = sizeof(uint32_t) * 2 + sizeof(RewindRegs) + len;
+    if (size > r->capacity) { // budget too small for even one frame
+        r->head = r->tail = r->frames = 0;
+        get_regs(emu, &r->regs);
+        return;
+    }
+    while (r->capacity - (r->head - r->tail) < size) { // drop the oldest
+        uint32_t old;
+        ring_read(r, r->tail, &old, sizeof(old));
+        r->tail += old;
+        r->frames--;
+    }
+    ring_write(r, r->head, &size, sizeof(size));
+    ring_write(r, r->head + sizeof(size), &r->regs, sizeof(RewindRegs));
+    ring_write(r, r->head + sizeof(size) + sizeof(RewindRegs), r->delta, len);
+    ring_write(r, r->head + size - sizeof(size), &size, sizeof(size));
+    r->head += size;
+    r->frames++;
+    get_regs(emu, &r->regs);
+}
+
+int octemu_rewind_pop(OctEmuRewind *r, OctEmu *emu) {
+    if (!r->frames)
+        return 1;
+    uint32_t size;
+    ring_read(r, r->head - sizeof(size), &size, sizeof(size));
+    r->head -= size;
+    r->frames--;
+    ring_read(r, r->head + sizeof(size), &r->regs, sizeof(RewindRegs));
+    ring_read(r, r->head + sizeof(size) + sizeof(RewindRegs), r->delta,
+              size - sizeof(size) * 2 - sizeof(RewindRegs));
+    decode_span(decode_span(r->delta, r->shadow), r->shadow + OCTEMU_MEM_SIZE);
+
+    octemu_read_mem(emu, 0, r->mem, OCTEMU_MEM_SIZE);
+    for (uint16_t addr = 0; addr < OCTEMU_MEM_SIZE; addr++) {
+        if (r->mem[addr] != r->shadow[addr])
+            octemu_write_mem(emu, addr, r->shadow + addr, 1);
+    }
+    memcpy(&emu->gfx, r->shadow + OCTEMU_MEM_SIZE, REWIND_GFX_SIZE);
+    set_regs(emu, &r->regs);
+    return 0;
+}
+
+size_t octemu_rewind_frames(const OctEmuRewind *r) { return r->frames; }
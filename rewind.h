@@ -0,0 +1,40 @@
+#ifndef _OCTEMU_REWIND_H_
+#define _OCTEMU_REWIND_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "core.h"
+
+/**
+ * Rewind buffer (opaque): a ring of per-frame snapshots within a fixed memory budget.
+ * Each snapshot keeps the registers and the XOR of memory and screen against the
+ * following frame, run-length encoded, so a frame where little changed takes a few
+ * hundred bytes. The oldest snapshots are dropped when the budget is used up.
+ */
+typedef struct OctEmuRewind OctEmuRewind;
+
+/**
+ * @param budget Bytes for snapshots
+ * @return NULL on failure
+ */
+OctEmuRewind *octemu_rewind_new(const size_t budget);
+void octemu_rewind_free(OctEmuRewind *);
+
+/* Drop all snapshots and start over from the current state of emu (e.g. after a reset). */
+void octemu_rewind_clear(OctEmuRewind *, const OctEmu *emu);
+
+/* Take a snapshot of emu, once per frame after octemu_tick(). */
+void octemu_rewind_push(OctEmuRewind *, const OctEmu *emu);
+
+/**
+ * Step back one frame: drop the newest snapshot and restore emu to the one before.
+ * Changes made since the last push are discarded.
+ * @return 0 on success, 1 if there is nothing left to rewind
+ */
+int octemu_rewind_pop(OctEmuRewind *, OctEmu *emu);
+
+/* Frames that can be rewound. */
+size_t octemu_rewind_frames(const OctEmuRewind *);
+
+#endif // _OCTEMU_REWIND_H_
@@ -39,10 +39,9 @@ const char *get_version() { return OCTEMU_VERSION; }
 
 EMSCRIPTEN_KEEPALIVE
 int set_mode(const int m) {
-    if (!emu_core || (m != OCTEMU_MODE_CHIP8 && m != OCTEMU_MODE_SCHIP && m != OCTEMU_MODE_OCTO))
+    if (!emu_core)
         return 1;
-    emu_core->mode = (OctEmuMode)m;
-    return 0;
+    return octemu_set_mode(emu_core, (OctEmuMode)m);
 }
 
 EMSCRIPTEN_KEEPALIVE
@@ -57,6 +56,8 @@ EMSCRIPTEN_KEEPALIVE
 void set_color(const uint32_t fg, const uint32_t bg) {
     color_fg = fg & 0xFFFFFF;
     color_bg = bg & 0xFFFFFF;
+    if (emu_core)
+        emu_core->gfx_dirty = OCTEMU_GFX_DIRTY_ALL;
 }
 
 EMSCRIPTEN_KEEPALIVE
@@ -67,7 +68,7 @@ int run(const uint8_t *rom, const size_t size) {
         octemu_clear_rom(emu_core);
     if (octemu_load_rom(emu_core, rom, size))
         return 1;
-    emu_core->gfx_dirty = true;
+    emu_core->gfx_dirty = OCTEMU_GFX_DIRTY_ALL;
     status = RUNNING;
     return 0;
 }
@@ -78,13 +79,8 @@ static uint64_t eval_loop(void *_, SDL_TimerID id, uint64_t interval) {
         return INTERVAL_NS * 10;
     }
 
-    int err = 0;
-    for (int i = 0; i < tickrate; i++) {
-        err = octemu_eval(emu_core, keypad);
-        if (err || (emu_core->mode == OCTEMU_MODE_CHIP8 && emu_core->gfx_dirty))
-            break;
-    }
-    if (err) {
+    const OctEmuRunResult res = octemu_run(emu_core, tickrate, keypad);
+    if (res.stop >= OCTEMU_STOP_EXIT) {
         emu_core->sound = 0;
         fputs("Emulator halted...\n", stderr);
         status = HALTED;
@@ -95,6 +91,36 @@ static uint64_t eval_loop(void *_, SDL_TimerID id, uint64_t interval) {
     return INTERVAL_NS;
 }
 
+// convert and upload dirty rows, one texture lock per run of consecutive rows
+static bool update_texture(const uint64_t dirty) {
+    for (int y = 0; y < OCTEMU_GFX_HEIGHT;) {
+        if (!(dirty >> y & 1)) {
+            y++;
+            continue;
+        }
+        int end = y + 1;
+        while (end < OCTEMU_GFX_HEIGHT && dirty >> end & 1)
+            end++;
+        const SDL_Rect rect = {0, y, OCTEMU_GFX_WIDTH, end - y};
+        uint32_t *pixels;
+        int pitch;
+        if (!SDL_LockTexture(texture, &rect, (void **)&pixels, &pitch))
+            return false;
+        for (; y < end; y++, pixels += pitch / sizeof(uint32_t)) {
+            uint64_t row[2];
+            octemu_get_row(emu_core, y, row);
+            for (int x = 0; x < OCTEMU_GFX_WIDTH; x++) {
+                if (row[x >> 6] >> (63 - (x & 63)) & 1)
+                    pixels[x] = (color_fg & 0xFFFFFF) | 0xFF000000;
+                else
+                    pixels[x] = (color_bg & 0xFFFFFF) | 0xFF000000;
+            }
+        }
+        SDL_UnlockTexture(texture);
+    }
+    return true;
+}
+
 static int printscreen() {
     SDL_Surface *surface = SDL_RenderReadPixels(renderer, NULL);
     if (!surface) {
@@ -150,7 +176,7 @@ SDL_AppResult SDL_AppInit(void **appstate, int argc, char *argv[]) {
         audio_samples[i * 2 + 1] = 64;
     }
 
-    srand((unsigned int)time(NULL));
+    octemu_set_seed(emu_core, (uint32_t)time(NULL));
     if (!SDL_AddTimerNS(INTERVAL_NS * 10, eval_loop, NULL))
         goto err;
     return SDL_APP_CONTINUE;
@@ -167,25 +193,8 @@ SDL_AppResult SDL_AppIterate(void *appstate) {
     } else if (SDL_GetAudioStreamQueued(audio_stream))
         SDL_ClearAudioStream(audio_stream);
 
-    if (emu_core->gfx_dirty) {
-        uint32_t *pixels;
-        int pitch;
-        if (!SDL_LockTexture(texture, NULL, (void **)&pixels, &pitch))
-            return SDL_APP_FAILURE;
-        for (int y = 0; y < OCTEMU_GFX_HEIGHT; y++) {
-            for (int x = 0; x < (OCTEMU_GFX_WIDTH >> 3); x++) {
-                for (int bit = 0; bit < 8; bit++) {
-                    const uint16_t pos = y * OCTEMU_GFX_WIDTH + x * 8 + bit;
-                    if (emu_core->gfx[y][x] & (1 << (7 - bit)))
-                        pixels[pos] = (color_fg & 0xFFFFFF) | 0xFF000000;
-                    else
-                        pixels[pos] = (color_bg & 0xFFFFFF) | 0xFF000000;
-                }
-            }
-        }
-        emu_core->gfx_dirty = false;
-        SDL_UnlockTexture(texture);
-    }
+    if (emu_core->gfx_dirty && !update_texture(octemu_take_gfx_dirty(emu_core)))
+        return SDL_APP_FAILURE;
     SDL_RenderTexture(renderer, texture, NULL, NULL);
     if (screenshot) {
         printscreen();